@@ -2,69 +2,193 @@
 #include "clang/AST/EvaluatedExprVisitor.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 using namespace clang;
 
+#include "BytecodeCache.h"
 #include "Environment.h"
+#include "ExecStats.h"
+#include "HostStack.h"
+#include "Lowering.h"
+#include "VM.h"
 
-class ReturnException : public std::exception {};
+enum class Engine { VM, AST };
 
-class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor>{
+struct InterpreterOptions {
+   Engine engine = Engine::VM;
+   bool dumpBytecode = false;
+   /// Expand calls to tiny leaf functions when lowering
+   bool inlineCalls = false;
+   /// Run element-wise array loops as SIMD kernels
+   bool vectorize = true;
+   bool stackStats = false;
+   bool heapStats = false;
+   /// Budget for guest call frames; the AST engine's host stack gets as much
+   size_t stackBytes = GuestStack::DefaultReserve;
+   /// Where lowered programs are kept between runs, if anywhere
+   BytecodeCache *cache = nullptr;
+   bool cacheStats = false;
+   /// Names the program in the cache and in snapshots
+   std::string cacheKey;
+   /// Where SNAPSHOT() saves the VM's state, and the snapshot to carry on from
+   std::string snapshotPath;
+   std::string restorePath;
+   bool prompt = true;
+   bool binaryOutput = false;
+   bool profile = false;
+   /// Entries of the memo table for pure functions; 0 turns memoization off
+   size_t memoize = 0;
+   bool memoStats = false;
+   /// Calls after which the VM compiles a function to native code; 0 turns the JIT off
+   int64_t jit = 0;
+   bool jitStats = false;
+   /// Where collapsed stacks go, if anywhere, and the name they are filed under
+   struct ProfileFile *profileFile = nullptr;
+   std::string programName;
+   /// --timing: when the frontend started on this program
+   bool timing = false;
+   std::chrono::steady_clock::time_point started;
+   /// --stats: count what the engine does and report it as JSON
+   bool stats = false;
+   /// The program's own channels for GET, PRINT and errors, and its reports
+   GuestIO *io = nullptr;
+   llvm::raw_ostream *report = &llvm::errs();
+};
+
+/// Collapsed stacks of every profiled program, gathered in one file. With
+/// several programs each stack starts with the program's name.
+struct ProfileFile {
+   std::mutex lock;
+   llvm::raw_fd_ostream &os;
+   bool byProgram;
+};
+
+static void reportProfile(Profiler &profiler, const InterpreterOptions &opts){
+   profiler.finish();
+   profiler.printSummary(*opts.report);
+   if (opts.profileFile){
+      std::lock_guard<std::mutex> guard(opts.profileFile->lock);
+      profiler.writeCollapsed(opts.profileFile->os, opts.profileFile->byProgram ? opts.programName : "");
+   }
+}
+
+/// Parse is everything up to the AST (or loading cached bytecode); execute
+/// is the rest, lowering included
+static void reportTiming(const InterpreterOptions &opts, std::chrono::steady_clock::time_point parsed){
+   typedef std::chrono::duration<double, std::milli> Ms;
+   Ms parse = parsed - opts.started;
+   Ms execute = std::chrono::steady_clock::now() - parsed;
+   *opts.report << llvm::format("timing: parse %.3f ms, execute %.3f ms\n", parse.count(), execute.count());
+}
+
+static void runBytecode(const BCProgram &prog, const InterpreterOptions &opts, ExecStats *stats = nullptr){
+   if (opts.dumpBytecode)
+      dumpProgram(prog, *opts.report);
+   // A restored run skips everything before the SNAPSHOT() call
+   std::unique_ptr<Snapshot> from;
+   if (!opts.restorePath.empty()){
+      from.reset(new Snapshot);
+      std::string err;
+      if (!from->load(opts.restorePath, err))
+         guestError(err);
+      if (from->key != opts.cacheKey)
+         guestError("snapshot " + opts.restorePath + " was taken of another program");
+   }
+   VM vm(prog, *opts.io, opts.stackBytes, from.get());
+   from.reset();
+   if (!opts.snapshotPath.empty())
+      vm.setSnapshot(opts.snapshotPath, opts.cacheKey);
+   if (stats)
+      vm.setStats(stats);
+   Profiler profiler;
+   std::unique_ptr<MemoTable> memo;
+   if (opts.memoize)
+      memo.reset(new MemoTable(opts.memoize));
+   try {
+      // Profiled and memoized runs stay interpreted
+      if (opts.jit && !opts.profile && !memo){
+         // Native calls recurse on the host stack, so it gets the whole budget
+         HostStack host(opts.stackBytes);
+         host.run([&](){
+            vm.enableJit(opts.jit, host.limit());
+            vm.run();
+         });
+      } else {
+         vm.run(opts.profile ? &profiler : NULL, memo.get());
+      }
+   } catch (const GuestExit &) {
+      if (opts.profile)
+         reportProfile(profiler, opts);
+      throw;
+   }
+   if (opts.profile)
+      reportProfile(profiler, opts);
+   if (opts.stackStats)
+      vm.getStack().printStats(*opts.report);
+   if (opts.heapStats)
+      vm.getHeap().printStats(*opts.report);
+   if (memo && opts.memoStats)
+      memo->printStats(*opts.report);
+   if (vm.getJit() && opts.jitStats)
+      vm.getJit()->printStats(*opts.report);
+}
+
+/// How a statement finished; anything but Normal unwinds to the enclosing
+/// loop or function body
+enum class Completion { Normal, Break, Continue, Return };
+
+class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor>, public StmtRunner{
 public:
    explicit InterpreterVisitor(const ASTContext &context, Environment *env)
-       : EvaluatedExprVisitor(context), mEnv(env) {}
+       : EvaluatedExprVisitor(context), mEnv(env) {
+      mEnv->setRunner(this);
+   }
    virtual ~InterpreterVisitor() {}
 
-   virtual void VisitBinaryOperator(BinaryOperator *bop){
-      VisitStmt(bop);
-      mEnv->binop(bop);
-   }
-   virtual void VisitDeclRefExpr(DeclRefExpr *expr){
-      VisitStmt(expr);
-      mEnv->declref(expr);
-   }
-   virtual void VisitParenExpr(ParenExpr *parenexpr){
-      VisitStmt(parenexpr);
-      mEnv->bind_paexprval(parenexpr);
-   }
-
-   virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *expr) {
-    mEnv->bind_ueot(expr);
-  }
-
-
-   virtual void VisitCallExpr(CallExpr *call){
-      VisitStmt(call);
-      mEnv->call(call);
-      if ((!call->getDirectCallee()->getName().equals("GET")) &&
-         (!call->getDirectCallee()->getName().equals("PRINT")) &&
-         (!call->getDirectCallee()->getName().equals("MALLOC")) &&
-         (!call->getDirectCallee()->getName().equals("FREE"))){
-             try {
-      VisitStmt(call->getDirectCallee()->getBody());
-    } catch (ReturnException e) {
-    }
-            int64_t retvalue = mEnv->mStack.back().getReturn();
-            mEnv->mStack.pop_back();
-            mEnv->mStack.back().bindStmt(call, retvalue);
-         }
+   // Expression statements; Environment evaluates sub-expressions itself
+   virtual void VisitExpr(Expr *expr){
+      mEnv->countLine(expr);
+      mEnv->get_exprval(expr);
+   }
+
+   virtual void runBody(Stmt *body){
+      Visit(body);
+      mCompletion = Completion::Normal;
+   }
+
+   virtual std::unique_ptr<StmtRunner> forThread(Environment &env){
+      return std::unique_ptr<StmtRunner>(new InterpreterVisitor(Context, &env));
+   }
+
+   virtual void VisitCompoundStmt(CompoundStmt *compound){
+      mEnv->countNode(compound);
+      for (auto i = compound->body_begin(), e = compound->body_end(); i != e; ++i){
+         Visit(*i);
+         if (mCompletion != Completion::Normal)
+            return;
+      }
    }
 
    virtual void VisitDeclStmt(DeclStmt *declstmt){
-      VisitStmt(declstmt);
+      mEnv->countLine(declstmt);
       mEnv->decl(declstmt);
    }
 
-   virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *arrayexpr) {
-    VisitStmt(arrayexpr);
-    mEnv->bind_array(arrayexpr);
-  }
-
    virtual void VisitIfStmt(IfStmt *ifstmt){
-
+      mEnv->countLine(ifstmt);
       Expr *cond = ifstmt->getCond();
-      Visit(cond);
       if (mEnv->get_exprval(cond))
          Visit(ifstmt->getThen()); 
       else{
@@ -74,69 +198,590 @@ public:
    }
 
    virtual void VisitWhileStmt(WhileStmt *whilestmt){
+      mEnv->countLine(whilestmt);
       while (mEnv->get_exprval(whilestmt->getCond())){
          Visit(whilestmt->getBody());
+         if (leaveLoop())
+            break;
       }
    }
 
    virtual void VisitForStmt(ForStmt *forstmt){
+      mEnv->countLine(forstmt);
       Stmt *forinit = forstmt->getInit();
       Expr *forcond = forstmt->getCond();
       Expr *forinc = forstmt->getInc();
       Stmt *forbody = forstmt->getBody();
       if (forinit)
          Visit(forinit);
-       while(mEnv->get_exprval(forcond)){
+      if (mEnv->runVectorLoop(forstmt))
+         return;
+       while(!forcond || mEnv->get_exprval(forcond)){
          Visit(forbody);
-         Visit(forinc);
+         if (leaveLoop())
+            break;
+         if (forinc)
+            mEnv->get_exprval(forinc);
       }
    }
 
    virtual void VisitReturnStmt(ReturnStmt *ret){
-      VisitStmt(ret);
-      mEnv->returnstmt(ret);
-      throw ReturnException();
+      mEnv->countLine(ret);
+      if (ret->getRetValue())
+         mEnv->returnstmt(ret);
+      mCompletion = Completion::Return;
+   }
+
+   virtual void VisitBreakStmt(BreakStmt *stmt){
+      mEnv->countLine(stmt);
+      mCompletion = Completion::Break;
+   }
+
+   virtual void VisitContinueStmt(ContinueStmt *stmt){
+      mEnv->countLine(stmt);
+      mCompletion = Completion::Continue;
    }
 
 private:
+   /// Called after each loop iteration: consumes break/continue and says
+   /// whether the loop must stop
+   bool leaveLoop(){
+      if (mCompletion == Completion::Break){
+         mCompletion = Completion::Normal;
+         return true;
+      }
+      if (mCompletion == Completion::Continue)
+         mCompletion = Completion::Normal;
+      return mCompletion == Completion::Return;
+   }
+
    Environment *mEnv;
+   Completion mCompletion = Completion::Normal;
 };
 
 class InterpreterConsumer : public ASTConsumer
 {
 public:
-   explicit InterpreterConsumer(const ASTContext &context) : mEnv(),
-         mVisitor(context, &mEnv){
+   explicit InterpreterConsumer(const ASTContext &context, const InterpreterOptions &opts) : mEnv(opts.stackBytes),
+         mVisitor(context, &mEnv), mOpts(opts){
+      mEnv.setIO(*opts.io);
+      mEnv.setVectorize(opts.vectorize);
    }
    virtual ~InterpreterConsumer() {}
 
    virtual void HandleTranslationUnit(clang::ASTContext &Context){
+      auto parsed = std::chrono::steady_clock::now();
+      if (mOpts.stats)
+         mStats.reset(new ExecStats(mOpts.programName, mOpts.started, parsed));
+      // A guest error only ends this program
+      try {
+         run(Context);
+      } catch (const GuestExit &e) {
+         mOpts.io->error(e.message);
+         if (mEnv.getProfiler())
+            reportProfile(*mEnv.getProfiler(), mOpts);
+      }
+      if (mOpts.timing)
+         reportTiming(mOpts, parsed);
+      if (mStats)
+         mStats->write(*mOpts.report);
+   }
+
+private:
+   void run(clang::ASTContext &Context){
       TranslationUnitDecl *decl = Context.getTranslationUnitDecl();
-      mEnv.init(decl);
+      mEnv.init(decl, Context.getSourceManager());
+      if (!mEnv.getEntry())
+         guestError("no main function");
+
+      if (mOpts.engine == Engine::VM){
+         BCProgram prog;
+         std::string err;
+         if (Lowering(mEnv, prog, mOpts.inlineCalls).lower(decl, err)){
+            if (mOpts.cache)
+               mOpts.cache->store(mOpts.cacheKey, prog);
+            runBytecode(prog, mOpts, mStats.get());
+            return;
+         }
+         // Constructs the VM doesn't know keep running on the AST engine
+         if (!mOpts.snapshotPath.empty() || !mOpts.restorePath.empty())
+            guestError("snapshots need a program the VM runs; not lowered: " + err);
+         if (mOpts.dumpBytecode)
+            *mOpts.report << "not lowered: " << err << "\n";
+      }
 
+      mEnv.start(decl);
       FunctionDecl *entry = mEnv.getEntry();
-      try {
-      mVisitor.VisitStmt(entry->getBody());
-    } catch (ReturnException e) {
-    }
+      if (mStats)
+         mEnv.setStats(mStats.get());
+      if (mOpts.profile){
+         mEnv.setProfiler(&mProfiler);
+         mProfiler.enter(mEnv.profileId(entry));
+      }
+      if (mOpts.memoize){
+         mMemo.reset(new MemoTable(mOpts.memoize));
+         mEnv.setMemo(mMemo.get());
+      }
+      // Guest calls recurse on the host stack here, so they get one sized to the budget
+      HostStack host(mOpts.stackBytes);
+      host.run([&](){
+         mEnv.setHostLimit(host.limit());
+         mVisitor.runBody(entry->getBody());
+      });
+      mEnv.joinThreads();
+      if (mOpts.profile)
+         reportProfile(mProfiler, mOpts);
+      if (mOpts.stackStats)
+         mEnv.getStack().printStats(*mOpts.report);
+      if (mOpts.heapStats)
+         mEnv.getHeap().printStats(*mOpts.report);
+      if (mMemo && mOpts.memoStats)
+         mMemo->printStats(*mOpts.report);
    }
 
-private:
+   /// Outlives mEnv, whose guest threads count into it until they are joined
+   std::unique_ptr<ExecStats> mStats;
    Environment mEnv;
    InterpreterVisitor mVisitor;
+   InterpreterOptions mOpts;
+   Profiler mProfiler;
+   std::unique_ptr<MemoTable> mMemo;
 };
 
 class InterpreterClassAction : public ASTFrontendAction{
 public:
+   explicit InterpreterClassAction(const InterpreterOptions &opts) : mOpts(opts) {}
+
    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
-       clang::CompilerInstance &Compiler, llvm::StringRef InFile){
+       clang::CompilerInstance &Compiler, llvm::StringRef /*InFile*/){
       return std::unique_ptr<clang::ASTConsumer>(
-          new InterpreterConsumer(Compiler.getASTContext()));
+          new InterpreterConsumer(Compiler.getASTContext(), mOpts));
+   }
+
+private:
+   InterpreterOptions mOpts;
+};
+
+/// One program of a run: the name diagnostics and reports use, and its source
+struct Program {
+   std::string name;
+   std::string code;
+};
+
+static bool readSource(const std::string &path, std::string &code){
+   std::stringstream buf;
+   if (path == "-")
+      buf << std::cin.rdbuf();
+   else {
+      std::ifstream in(path);
+      // A directory opens, then reads as nothing
+      if (!in || llvm::sys::fs::is_directory(path))
+         return false;
+      buf << in.rdbuf();
+   }
+   code = buf.str();
+   return true;
+}
+
+/// A manifest lists one program path per line; blank lines and lines
+/// starting with '#' are skipped
+static bool readManifest(const std::string &path, std::vector<std::string> &paths){
+   std::string text;
+   if (!readSource(path, text))
+      return false;
+   std::stringstream lines(text);
+   std::string line;
+   while (std::getline(lines, line)){
+      llvm::StringRef entry = llvm::StringRef(line).trim();
+      if (!entry.empty() && !entry.startswith("#"))
+         paths.push_back(entry.str());
    }
+   return true;
+}
+
+/// Parses and runs programs one after another. The file manager and the
+/// in-memory file system holding the sources are set up once and shared by
+/// all of them, so each program only pays for its own parse. Programs the
+/// bytecode cache already holds skip Clang altogether.
+class ProgramRunner {
+public:
+   ProgramRunner()
+       : mFS(new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem())),
+         mSources(new llvm::vfs::InMemoryFileSystem),
+         mPCH(std::make_shared<PCHContainerOperations>()) {
+      mFS->pushOverlay(mSources);
+      mFiles = new FileManager(FileSystemOptions(), mFS);
+   }
+
+   /// False if the program doesn't parse
+   bool run(const Program &program, const InterpreterOptions &opts){
+      InterpreterOptions programOpts = opts;
+      programOpts.programName = program.name;
+      programOpts.started = std::chrono::steady_clock::now();
+      if (opts.cache || !opts.snapshotPath.empty() || !opts.restorePath.empty()){
+         // Options that change the lowered program are part of the key
+         std::string options = opts.inlineCalls ? "inline" : "";
+         if (!opts.vectorize)
+            options += " novec";
+         programOpts.cacheKey = BytecodeCache::key(program.name, program.code, options);
+      }
+      if (opts.cache){
+         BCProgram prog;
+         if (opts.cache->load(programOpts.cacheKey, prog)){
+            auto loaded = std::chrono::steady_clock::now();
+            std::unique_ptr<ExecStats> stats;
+            if (opts.stats)
+               stats.reset(new ExecStats(program.name, programOpts.started, loaded));
+            try {
+               runBytecode(prog, programOpts, stats.get());
+            } catch (const GuestExit &e) {
+               opts.io->error(e.message);
+            }
+            if (opts.timing)
+               reportTiming(programOpts, loaded);
+            if (stats)
+               stats->write(*opts.report);
+            return true;
+         }
+      }
+      mSources->addFile(program.name, 0, llvm::MemoryBuffer::getMemBufferCopy(program.code));
+      // Sources are C++ whatever their extension, as runToolOnCode's input.cc was
+      std::vector<std::string> args = {"ast-interpreter", "-fsyntax-only", "-xc++", program.name};
+      clang::tooling::ToolInvocation invocation(args, std::make_unique<InterpreterClassAction>(programOpts),
+                                                mFiles.get(), mPCH);
+      llvm::IntrusiveRefCntPtr<DiagnosticOptions> diagOpts(new DiagnosticOptions());
+      TextDiagnosticPrinter diags(*opts.report, diagOpts.get());
+      invocation.setDiagnosticConsumer(&diags);
+      return invocation.run();
+   }
+
+private:
+   llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> mFS;
+   llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> mSources;
+   llvm::IntrusiveRefCntPtr<FileManager> mFiles;
+   std::shared_ptr<PCHContainerOperations> mPCH;
 };
 
+static void printHeader(GuestOutput &out, const std::vector<Program> &programs, size_t i){
+   if (programs.size() > 1 && !out.binary())
+      out.text("==> " + programs[i].name + " <==\n");
+}
+
+/// Runs the programs on the calling thread. They share the process's
+/// channels: input carries on where the previous program stopped reading.
+static int runSerial(const std::vector<Program> &programs, const InterpreterOptions &opts,
+                     GuestInput &in, GuestOutput &out){
+   GuestIO io(in, out, opts.prompt);
+   InterpreterOptions runOpts = opts;
+   runOpts.io = &io;
+   ProgramRunner runner;
+   int failed = 0;
+   for (size_t i = 0; i < programs.size(); i++){
+      printHeader(out, programs, i);
+      if (!runner.run(programs[i], runOpts))
+         failed++;
+   }
+   return failed;
+}
+
+/// Runs the programs on jobs threads. Every program gets an Environment or
+/// VM of its own and writes into buffers of its own, which are printed in
+/// program order as soon as all earlier programs have been printed. GET
+/// reads <name>.in when it exists, and sees end of input otherwise.
+static int runParallel(const std::vector<Program> &programs, const InterpreterOptions &opts, unsigned jobs,
+                       GuestOutput &out){
+   struct Result {
+      std::string output;
+      std::string report;
+      bool parsed = false;
+      bool done = false;
+   };
+   std::vector<Result> results(programs.size());
+   std::mutex lock;
+   std::condition_variable finished;
+   std::atomic<size_t> next(0);
+
+   auto work = [&](){
+      ProgramRunner runner;
+      for (size_t i; (i = next++) < programs.size();){
+         std::unique_ptr<GuestInput> in;
+         // Open until the program is done: input that couldn't be mapped is read from it
+         int fd = open((programs[i].name + ".in").c_str(), O_RDONLY);
+         if (fd >= 0)
+            in.reset(new GuestInput(fd));
+         else
+            in.reset(new GuestInput(std::string()));
+         std::string output, report;
+         GuestOutput programOut(output, opts.binaryOutput);
+         GuestIO io(*in, programOut, opts.prompt);
+         llvm::raw_string_ostream reportStream(report);
+         InterpreterOptions programOpts = opts;
+         programOpts.io = &io;
+         programOpts.report = &reportStream;
+         bool parsed = runner.run(programs[i], programOpts);
+         programOut.flush();
+         reportStream.flush();
+         if (fd >= 0)
+            close(fd);
+         std::lock_guard<std::mutex> guard(lock);
+         results[i].output = std::move(output);
+         results[i].report = std::move(report);
+         results[i].parsed = parsed;
+         results[i].done = true;
+         finished.notify_all();
+      }
+   };
+   std::vector<std::thread> workers;
+   for (unsigned j = 0; j < jobs; j++)
+      workers.emplace_back(work);
+
+   int failed = 0;
+   for (size_t i = 0; i < programs.size(); i++){
+      Result result;
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         finished.wait(guard, [&](){ return results[i].done; });
+         result = std::move(results[i]);
+      }
+      printHeader(out, programs, i);
+      out.write(result.output.data(), result.output.size());
+      llvm::errs() << result.report;
+      if (!result.parsed)
+         failed++;
+   }
+   for (std::thread &worker : workers)
+      worker.join();
+   return failed;
+}
+
+static int runPrograms(const std::vector<Program> &programs, const InterpreterOptions &opts, unsigned jobs,
+                       GuestInput &in){
+   GuestOutput out(STDOUT_FILENO, opts.binaryOutput);
+   jobs = std::min<size_t>(jobs, programs.size());
+   int failed = jobs > 1 ? runParallel(programs, opts, jobs, out) : runSerial(programs, opts, in, out);
+   out.flush();
+   if (opts.cache && opts.cacheStats)
+      opts.cache->printStats(llvm::errs());
+   return failed ? 1 : 0;
+}
+
+/// A byte count with an optional k, m or g suffix
+static bool parseBytes(llvm::StringRef text, size_t &bytes){
+   unsigned shift = 0;
+   switch (text.empty() ? 0 : tolower(text.back())){
+   case 'k': shift = 10; break;
+   case 'm': shift = 20; break;
+   case 'g': shift = 30; break;
+   }
+   if (shift)
+      text = text.drop_back();
+   uint64_t val;
+   if (text.getAsInteger(10, val) || val > (SIZE_MAX >> shift))
+      return false;
+   bytes = (size_t)val << shift;
+   return true;
+}
+
+static bool addFile(std::vector<Program> &programs, const std::string &path){
+   Program program;
+   program.name = path == "-" ? "stdin.cc" : path;
+   if (!readSource(path, program.code)){
+      llvm::errs() << "error: can't read " << path << "\n";
+      return false;
+   }
+   programs.push_back(program);
+   return true;
+}
+
+static const char Usage[] = R"(usage: ast-interpreter [options] <program>...
+A program is a file path, - for stdin, or the source code itself: anything
+with a { or ; in it that isn't a file.
+
+Running
+  --engine=vm|ast        run on the bytecode VM (default) or the AST engine
+  --batch=<manifest>     add every path the manifest lists
+  --jobs=N               run N programs at a time; 0 means one per core
+  --input=<file>         feed GET from a file instead of stdin
+  --no-prompt            drop GET's prompt
+  --binary-output        have PRINT write raw 8-byte values
+  --stack-limit=N[k|m|g] cap guest call frames at N bytes (256m); deeper
+                         recursion ends the program with a stack overflow
+
+Speed
+  --no-cache             don't keep lowered bytecode between runs
+  --cache-dir=<dir>      where it is kept
+  --inline               expand calls to functions that only return an
+                         expression of their parameters
+  --no-vectorize         run array fill loops element by element, not as
+                         SSE/AVX2 kernels
+  --memoize[=N]          cache results of pure functions in N entries (65536)
+  --jit[=N]              compile a function to native code once it has been
+                         called N times (100); profiled and memoized runs
+                         stay interpreted
+  --snapshot=<file>      have SNAPSHOT() save the VM's state there
+  --restore=<file>       start a later run of the same program right after
+                         that SNAPSHOT(); GET reads the new run's input
+
+Reports
+  --timing               parse and execute time per program
+  --profile[=<file>]     time per function and executions per line; collapsed
+                         stacks go to the file
+  --stats                a line of JSON per program: nodes or instructions run
+                         by kind, calls, frames, variable reads and writes,
+                         array and MALLOC bytes; SIGUSR1 reports the programs
+                         still running; JIT-compiled code isn't counted
+  --stack-stats, --heap-stats, --cache-stats, --memo-stats, --jit-stats
+  --dump-bytecode        print the lowered program
+
+Builtins: GET, PRINT, MALLOC, FREE, SNAPSHOT, SPAWN(fn, arg) and JOIN(handle)
+for up to 64 guest threads with stacks of at most 32m, ATOMIC_ADD(p, v) and
+ATOMIC_CAS(p, expected, desired) on int or long. A load or store outside the
+guest's stack and heap, or freeing what MALLOC didn't return, ends the program
+with a guest error; so does a guest thread's, at JOIN or once main returns.
+)";
+
+/// Runs every program named on the command line; --help lists the options
 int main(int argc, char **argv){
-   if (argc > 1){
-      clang::tooling::runToolOnCode(std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction), argv[1]);
+   InterpreterOptions opts;
+   bool useCache = true;
+   unsigned jobs = 1;
+   std::string inputPath;
+   std::string profilePath;
+   std::string cacheDir = BytecodeCache::defaultDir();
+   std::vector<Program> programs;
+   std::vector<size_t> inline_programs;
+   for (int i = 1; i < argc; i++){
+      llvm::StringRef arg(argv[i]);
+      if (arg == "--help" || arg == "-h"){
+         llvm::outs() << Usage;
+         return 0;
+      }
+      else if (arg == "--engine=ast")
+         opts.engine = Engine::AST;
+      else if (arg == "--engine=vm")
+         opts.engine = Engine::VM;
+      else if (arg == "--dump-bytecode")
+         opts.dumpBytecode = true;
+      else if (arg == "--inline")
+         opts.inlineCalls = true;
+      else if (arg == "--no-vectorize")
+         opts.vectorize = false;
+      else if (arg == "--stack-stats")
+         opts.stackStats = true;
+      else if (arg == "--heap-stats")
+         opts.heapStats = true;
+      else if (arg == "--no-cache")
+         useCache = false;
+      else if (arg.startswith("--cache-dir="))
+         cacheDir = arg.drop_front(strlen("--cache-dir=")).str();
+      else if (arg == "--cache-stats")
+         opts.cacheStats = true;
+      else if (arg == "--no-prompt")
+         opts.prompt = false;
+      else if (arg == "--binary-output")
+         opts.binaryOutput = true;
+      else if (arg.startswith("--input="))
+         inputPath = arg.drop_front(strlen("--input=")).str();
+      else if (arg == "--memoize")
+         opts.memoize = 1 << 16;
+      else if (arg.startswith("--memoize=")){
+         if (arg.drop_front(strlen("--memoize=")).getAsInteger(10, opts.memoize) || !opts.memoize)
+            opts.memoize = 1 << 16;
+      }
+      else if (arg == "--jit")
+         opts.jit = 100;
+      else if (arg.startswith("--jit=")){
+         if (arg.drop_front(strlen("--jit=")).getAsInteger(10, opts.jit) || opts.jit < 1)
+            opts.jit = 100;
+      }
+      else if (arg == "--jit-stats")
+         opts.jitStats = true;
+      else if (arg.startswith("--snapshot="))
+         opts.snapshotPath = arg.drop_front(strlen("--snapshot=")).str();
+      else if (arg.startswith("--restore="))
+         opts.restorePath = arg.drop_front(strlen("--restore=")).str();
+      else if (arg == "--memo-stats")
+         opts.memoStats = true;
+      else if (arg.startswith("--stack-limit=")){
+         if (!parseBytes(arg.drop_front(strlen("--stack-limit=")), opts.stackBytes) || opts.stackBytes < 64 << 10){
+            llvm::errs() << "error: bad stack limit " << arg << "; want at least 64k\n";
+            return 1;
+         }
+      }
+      else if (arg == "--timing")
+         opts.timing = true;
+      else if (arg == "--stats")
+         opts.stats = true;
+      else if (arg == "--profile")
+         opts.profile = true;
+      else if (arg.startswith("--profile=")){
+         opts.profile = true;
+         profilePath = arg.drop_front(strlen("--profile=")).str();
+      }
+      else if (arg.startswith("--jobs=")){
+         if (arg.drop_front(strlen("--jobs=")).getAsInteger(10, jobs) || !jobs)
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+      }
+      else if (arg.startswith("--batch=")){
+         std::vector<std::string> paths;
+         if (!readManifest(arg.drop_front(strlen("--batch=")).str(), paths)){
+            llvm::errs() << "error: can't read manifest " << arg << "\n";
+            return 1;
+         }
+         for (const std::string &path : paths)
+            if (!addFile(programs, path))
+               return 1;
+      }
+      else if (arg.startswith("-") && arg != "-"){
+         llvm::errs() << "error: unknown option " << arg << "; see --help\n";
+         return 1;
+      }
+      // Source has a body or a declaration in it; anything else names a file
+      else if (llvm::sys::fs::is_regular_file(arg) || arg.find_first_of("{;") == llvm::StringRef::npos){
+         if (!addFile(programs, arg.str()))
+            return 1;
+      }
+      else {
+         inline_programs.push_back(programs.size());
+         programs.push_back(Program{"input.cc", arg.str()});
+      }
+   }
+   // Inline source keeps the name runToolOnCode gave it unless there are several
+   if (inline_programs.size() > 1)
+      for (size_t i = 0; i < inline_programs.size(); i++)
+         programs[inline_programs[i]].name = "input" + std::to_string(i + 1) + ".cc";
+   if (!opts.snapshotPath.empty() || !opts.restorePath.empty()){
+      if (opts.engine != Engine::VM || programs.size() != 1){
+         llvm::errs() << "error: --snapshot and --restore take a single program on the VM engine\n";
+         return 1;
+      }
+      if (!opts.restorePath.empty() && opts.profile){
+         llvm::errs() << "error: --restore can't be combined with --profile\n";
+         return 1;
+      }
+   }
+   // Before any thread starts, so that all of them leave the signal to the watcher
+   if (opts.stats)
+      ExecStats::dumpOnSignal(SIGUSR1);
+   // Only the VM runs cached programs
+   BytecodeCache cache(cacheDir);
+   if (useCache && opts.engine == Engine::VM)
+      opts.cache = &cache;
+   // GET reads stdin unless --input names a file; both are mapped when they can be
+   int inputFd = STDIN_FILENO;
+   if (!inputPath.empty() && (inputFd = open(inputPath.c_str(), O_RDONLY)) < 0){
+      llvm::errs() << "error: can't read " << inputPath << "\n";
+      return 1;
+   }
+   GuestInput in(inputFd);
+   std::error_code ec;
+   llvm::raw_fd_ostream folded(profilePath.empty() ? "-" : profilePath, ec);
+   if (ec){
+      llvm::errs() << "error: can't write " << profilePath << ": " << ec.message() << "\n";
+      return 1;
    }
-}
\ No newline at end of file
+   ProfileFile profileFile{{}, folded, programs.size() > 1};
+   if (!profilePath.empty())
+      opts.profileFile = &profileFile;
+   return runPrograms(programs, opts, jobs, in);
+}
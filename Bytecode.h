@@ -0,0 +1,173 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "llvm/Support/raw_ostream.h"
+#include "TypedAccess.h"
+#include "VecKernel.h"
+
+/// Register-based bytecode produced by Lowering and executed by VM.
+/// Every function owns a window of numRegs int64_t registers; parameters
+/// occupy the first numParams registers, locals and temporaries follow.
+/// Jump targets are absolute instruction indices within the function.
+/// Memory accesses come in one opcode per element kind (T below), in
+/// ElemKind order, so the VM runs a kernel specialised for the type.
+enum Opcode : uint8_t{
+	OP_MOV,        // R[a] = R[b]
+	OP_LOADI,      // R[a] = b
+	OP_LOADK,      // R[a] = K[b]
+	OP_GETG,       // R[a] = G[b]
+	OP_SETG,       // G[a] = R[b]
+	OP_ADD,        // R[a] = R[b] + R[c]
+	OP_ADDI,       // R[a] = R[b] + c
+	OP_SUB,        // R[a] = R[b] - R[c]
+	OP_MUL,        // R[a] = R[b] * R[c]
+	OP_MULI,       // R[a] = R[b] * c
+	OP_DIV,        // R[a] = R[b] / R[c]
+	OP_LT,         // R[a] = R[b] < R[c]
+	OP_GT,         // R[a] = R[b] > R[c]
+	OP_EQ,         // R[a] = R[b] == R[c]
+	OP_LE,         // R[a] = R[b] <= R[c]
+	OP_GE,         // R[a] = R[b] >= R[c]
+	OP_NEG,        // R[a] = -R[b]
+	OP_NOT,        // R[a] = ~R[b]
+	OP_LNOT,       // R[a] = !R[b]
+	OP_LDELEM_I8,  // R[a] = ((T *)R[b])[R[c]]
+	OP_LDELEM_U8,
+	OP_LDELEM_I16,
+	OP_LDELEM_U16,
+	OP_LDELEM_I32,
+	OP_LDELEM_U32,
+	OP_LDELEM_I64,
+	OP_STELEM_I8,  // ((T *)R[a])[R[b]] = R[c]
+	OP_STELEM_I16,
+	OP_STELEM_I32,
+	OP_STELEM_I64,
+	OP_LOAD_I8,    // R[a] = ((T *)R[b])[c]
+	OP_LOAD_U8,
+	OP_LOAD_I16,
+	OP_LOAD_U16,
+	OP_LOAD_I32,
+	OP_LOAD_U32,
+	OP_LOAD_I64,
+	OP_STORE_I8,   // ((T *)R[a])[c] = R[b]
+	OP_STORE_I16,
+	OP_STORE_I32,
+	OP_STORE_I64,
+	OP_ALLOCA,     // R[a] = frame array area + b, zero-filled for c bytes
+	OP_JMP,        // pc = a
+	OP_JZ,         // if (!R[a]) pc = b
+	OP_JNZ,        // if (R[a]) pc = b
+	OP_JLT,        // if (R[a] < R[b]) pc = c
+	OP_JLE,        // if (R[a] <= R[b]) pc = c
+	OP_JEQ,        // if (R[a] == R[b]) pc = c
+	OP_JNE,        // if (R[a] != R[b]) pc = c
+	OP_JLTI,       // if (R[a] < b) pc = c
+	OP_JGTI,       // if (R[a] > b) pc = c
+	OP_JEQI,       // if (R[a] == b) pc = c
+	OP_JNEI,       // if (R[a] != b) pc = c
+	OP_VLOOP,      // runVecLoop(V[a], R, R[b])
+	OP_CALL,       // R[a] = F[b](R[c], ..., R[c + F[b].numParams - 1])
+	OP_RET,        // return R[a]
+	OP_GET,        // R[a] = GET()
+	OP_PRINT,      // PRINT(R[a])
+	OP_MALLOC,     // R[a] = MALLOC(R[b]), allocation site c
+	OP_FREE,       // FREE(R[a])
+	OP_SNAPSHOT,   // SNAPSHOT()
+	OP_SPAWN,      // R[a] = SPAWN(functions[b], R[c])
+	OP_JOIN,       // R[a] = JOIN(R[b])
+	OP_XADD_I32,   // R[a] = ATOMIC_ADD((int *)R[b], R[c])
+	OP_XADD_I64,   // R[a] = ATOMIC_ADD((long *)R[b], R[c])
+	OP_CAS_I32,    // R[a] = ATOMIC_CAS((int *)R[b], R[c], R[c+1])
+	OP_CAS_I64,    // R[a] = ATOMIC_CAS((long *)R[b], R[c], R[c+1])
+	OP_NUM_OPCODES
+};
+
+struct Insn{
+	Opcode op;
+	int32_t a;
+	int32_t b;
+	int32_t c;
+};
+
+struct BCFunction{
+	std::string name;
+	int32_t numParams = 0;
+	int32_t numRegs = 0;
+	/// Bytes of local arrays placed after the registers in each frame
+	int64_t arrayBytes = 0;
+	/// Result depends only on the arguments (see PurityAnalysis), so calls
+	/// may be answered from a MemoTable
+	bool pure = false;
+	std::vector<Insn> code;
+	/// Per instruction: the source line of the statement it starts, or 0
+	std::vector<int32_t> lines;
+};
+
+struct BCProgram{
+	std::vector<BCFunction> functions;
+	std::vector<int64_t> constants;
+	int32_t numGlobals = 0;
+	/// Names of MALLOC call sites, indexed by OP_MALLOC's c
+	std::vector<std::string> allocSites;
+	/// Loops OP_VLOOP runs as SIMD kernels; their slots are registers
+	std::vector<VecLoop> vecLoops;
+	/// Index of the synthetic function that initializes globals and calls main
+	int32_t entry = -1;
+};
+
+inline const char *opcodeName(Opcode op){
+	static const char *names[OP_NUM_OPCODES] = {
+		"mov", "loadi", "loadk", "getg", "setg",
+		"add", "addi", "sub", "mul", "muli", "div", "lt", "gt", "eq", "le", "ge",
+		"neg", "not", "lnot",
+		"ldelem.i8", "ldelem.u8", "ldelem.i16", "ldelem.u16", "ldelem.i32", "ldelem.u32", "ldelem.i64",
+		"stelem.i8", "stelem.i16", "stelem.i32", "stelem.i64",
+		"load.i8", "load.u8", "load.i16", "load.u16", "load.i32", "load.u32", "load.i64",
+		"store.i8", "store.i16", "store.i32", "store.i64", "alloca",
+		"jmp", "jz", "jnz", "jlt", "jle", "jeq", "jne", "jlti", "jgti", "jeqi", "jnei", "vloop", "call", "ret",
+		"get", "print", "malloc", "free", "snapshot",
+		"spawn", "join", "xadd.i32", "xadd.i64", "cas.i32", "cas.i64"
+	};
+	return op < OP_NUM_OPCODES ? names[op] : "???";
+}
+
+/// Loads and stores of kind; stores only distinguish widths
+inline Opcode ldelemOp(ElemKind kind){
+	return (Opcode)(OP_LDELEM_I8 + kind);
+}
+inline Opcode loadOp(ElemKind kind){
+	return (Opcode)(OP_LOAD_I8 + kind);
+}
+inline Opcode stelemOp(ElemKind kind){
+	return (Opcode)(OP_STELEM_I8 + kind / 2);
+}
+inline Opcode storeOp(ElemKind kind){
+	return (Opcode)(OP_STORE_I8 + kind / 2);
+}
+
+inline void dumpProgram(const BCProgram &prog, llvm::raw_ostream &os){
+	for (size_t f = 0; f < prog.functions.size(); f++){
+		const BCFunction &fn = prog.functions[f];
+		os << "function #" << f << " " << fn.name << " (params=" << fn.numParams
+		   << ", regs=" << fn.numRegs << ", array bytes=" << fn.arrayBytes << (fn.pure ? ", pure" : "") << ")\n";
+		for (size_t pc = 0; pc < fn.code.size(); pc++){
+			const Insn &insn = fn.code[pc];
+			os << "  " << pc << ":\t" << opcodeName(insn.op) << "\t" << insn.a << ", " << insn.b << ", " << insn.c << "\n";
+		}
+	}
+	static const char *vecOps[] = {"index", "const", "scalar", "load", "add", "sub", "mul", "neg"};
+	for (size_t v = 0; v < prog.vecLoops.size(); v++){
+		const VecLoop &loop = prog.vecLoops[v];
+		os << "vloop #" << v << " (array=" << loop.array << ", kind=" << loop.dst << ", index=" << loop.index
+		   << (loop.inclusive ? ", inclusive" : "") << "):";
+		for (const VecOp &op : loop.ops){
+			os << " " << vecOps[op.op];
+			if (op.op == VEC_CONST)
+				os << "(" << op.value << ")";
+			else if (op.op == VEC_SCALAR || op.op == VEC_LOAD)
+				os << "(" << op.operand << ")";
+		}
+		os << "\n";
+	}
+}
@@ -0,0 +1,346 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Bytecode.h"
+
+/// On-disk cache of lowered programs, keyed by a hash of the program's name
+/// and source. A hit hands the VM its BCProgram without running Clang at
+/// all. Entries are written to a temporary file and renamed into place, so
+/// concurrent runs never read a partial one. Parallel jobs share a cache.
+class BytecodeCache{
+	/// Bump whenever the bytecode or this file format changes
+	static const uint32_t Version = 10;
+	static const uint32_t Magic = 0x43425341; // "ASBC"
+
+	std::string mDir;
+	std::atomic<int64_t> mHits;
+	std::atomic<int64_t> mMisses;
+	std::atomic<int64_t> mStores;
+
+public:
+	explicit BytecodeCache(const std::string &dir) : mDir(dir), mHits(0), mMisses(0), mStores(0){
+	}
+
+	/// $XDG_CACHE_HOME/ast-interpreter or its platform equivalent
+	static std::string defaultDir(){
+		llvm::SmallString<128> dir;
+		if (!llvm::sys::path::cache_directory(dir))
+			return "";
+		llvm::sys::path::append(dir, "ast-interpreter");
+		return dir.str().str();
+	}
+
+	/// options names whatever besides the source changes the lowered code
+	static std::string key(const std::string &name, const std::string &code, const std::string &options = ""){
+		std::string text = name + '\0' + options + '\0' + code;
+		auto digest = llvm::SHA1::hash(llvm::ArrayRef<uint8_t>((const uint8_t *)text.data(), text.size()));
+		return llvm::toHex(digest, true);
+	}
+
+	bool load(const std::string &key, BCProgram &prog){
+		auto buf = llvm::MemoryBuffer::getFile(path(key));
+		if (buf && Reader((*buf)->getBuffer()).program(prog)){
+			mHits++;
+			return true;
+		}
+		prog = BCProgram();
+		mMisses++;
+		return false;
+	}
+
+	/// Failing to store only costs the next run a parse, so it's silent
+	void store(const std::string &key, const BCProgram &prog){
+		if (mDir.empty() || llvm::sys::fs::create_directories(mDir))
+			return;
+		int fd;
+		llvm::SmallString<128> tmp;
+		if (llvm::sys::fs::createUniqueFile(mDir + "/%%%%%%%%.tmp", fd, tmp))
+			return;
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			write(os, prog);
+			if (os.has_error()){
+				os.clear_error();
+				llvm::sys::fs::remove(tmp);
+				return;
+			}
+		}
+		if (llvm::sys::fs::rename(tmp, path(key)))
+			llvm::sys::fs::remove(tmp);
+		else
+			mStores++;
+	}
+
+	void printStats(llvm::raw_ostream &os) const{
+		os << "bytecode cache: " << mHits << " hits, " << mMisses << " misses, " << mStores << " stored";
+		if (!mDir.empty())
+			os << " in " << mDir;
+		os << "\n";
+	}
+
+private:
+	std::string path(const std::string &key) const{
+		return mDir + "/" + key + ".bc";
+	}
+
+	static void put(llvm::raw_ostream &os, int64_t val){
+		os.write((const char *)&val, sizeof(val));
+	}
+	static void put(llvm::raw_ostream &os, const std::string &str){
+		put(os, (int64_t)str.size());
+		os << str;
+	}
+
+	static void write(llvm::raw_ostream &os, const BCProgram &prog){
+		put(os, Magic);
+		put(os, Version);
+		put(os, prog.numGlobals);
+		put(os, prog.entry);
+		put(os, (int64_t)prog.constants.size());
+		for (int64_t k : prog.constants)
+			put(os, k);
+		put(os, (int64_t)prog.allocSites.size());
+		for (const std::string &site : prog.allocSites)
+			put(os, site);
+		put(os, (int64_t)prog.vecLoops.size());
+		for (const VecLoop &loop : prog.vecLoops){
+			put(os, loop.dst);
+			put(os, loop.array);
+			put(os, loop.index);
+			put(os, loop.inclusive);
+			put(os, (int64_t)loop.ops.size());
+			for (const VecOp &op : loop.ops){
+				put(os, op.op);
+				put(os, op.kind);
+				put(os, op.operand);
+				put(os, op.value);
+			}
+		}
+		put(os, (int64_t)prog.functions.size());
+		for (const BCFunction &fn : prog.functions){
+			put(os, fn.name);
+			put(os, fn.numParams);
+			put(os, fn.numRegs);
+			put(os, fn.arrayBytes);
+			put(os, fn.pure);
+			put(os, (int64_t)fn.code.size());
+			for (size_t pc = 0; pc < fn.code.size(); pc++){
+				const Insn &insn = fn.code[pc];
+				put(os, insn.op);
+				put(os, insn.a);
+				put(os, insn.b);
+				put(os, insn.c);
+				put(os, fn.lines[pc]);
+			}
+		}
+	}
+
+	/// Reads back what write() wrote, rejecting anything truncated or stale
+	class Reader{
+		llvm::StringRef mData;
+		bool mOk;
+
+	public:
+		explicit Reader(llvm::StringRef data) : mData(data), mOk(true){
+		}
+
+		bool program(BCProgram &prog){
+			if (get() != Magic || get() != Version)
+				return false;
+			prog.numGlobals = get();
+			prog.entry = get();
+			prog.constants.resize(count());
+			for (int64_t &k : prog.constants)
+				k = get();
+			prog.allocSites.resize(count());
+			for (std::string &site : prog.allocSites)
+				site = str();
+			prog.vecLoops.resize(count());
+			for (VecLoop &loop : prog.vecLoops){
+				loop.dst = (ElemKind)get();
+				loop.array = get();
+				loop.index = get();
+				loop.inclusive = get();
+				loop.ops.resize(count());
+				for (VecOp &op : loop.ops){
+					int64_t kind = get();
+					if (kind < VEC_INDEX || kind > VEC_NEG)
+						mOk = false;
+					op.op = (VecOpKind)kind;
+					op.kind = (ElemKind)get();
+					op.operand = get();
+					op.value = get();
+				}
+			}
+			prog.functions.resize(count());
+			for (BCFunction &fn : prog.functions){
+				fn.name = str();
+				fn.numParams = get();
+				fn.numRegs = get();
+				fn.arrayBytes = get();
+				fn.pure = get();
+				fn.code.resize(count());
+				fn.lines.resize(fn.code.size());
+				for (size_t pc = 0; pc < fn.code.size(); pc++){
+					Insn &insn = fn.code[pc];
+					int64_t op = get();
+					insn.op = (Opcode)(op >= 0 && op < OP_NUM_OPCODES ? op : (int64_t)OP_NUM_OPCODES);
+					insn.a = get();
+					insn.b = get();
+					insn.c = get();
+					fn.lines[pc] = get();
+				}
+			}
+			return mOk && mData.empty() && valid(prog);
+		}
+
+		/// Whether every operand names something that exists: a register of
+		/// its function, a constant, global, function, vloop or allocation
+		/// site of the program, an instruction to jump to. The VM and the Jit
+		/// index with them unchecked, so a bad one rejects the whole entry.
+		static bool valid(const BCProgram &prog){
+			if (prog.numGlobals < 0 || prog.entry < 0 || prog.entry >= (int64_t)prog.functions.size()
+			    || prog.functions[prog.entry].numParams != 0)
+				return false;
+			for (const VecLoop &loop : prog.vecLoops)
+				if (!valid(loop))
+					return false;
+			for (const BCFunction &fn : prog.functions){
+				if (fn.numParams < 0 || fn.numRegs < fn.numParams || fn.arrayBytes < 0 || fn.arrayBytes > INT32_MAX)
+					return false;
+				// Running off the end of the code isn't possible either
+				if (fn.code.empty() || (fn.code.back().op != OP_RET && fn.code.back().op != OP_JMP))
+					return false;
+				for (const Insn &insn : fn.code)
+					if (!valid(prog, fn, insn))
+						return false;
+			}
+			return true;
+		}
+
+		static bool valid(ElemKind kind){
+			return kind >= EK_I8 && kind <= EK_I64;
+		}
+		/// Kinds in range, and a body that leaves one value on the kernel's stack
+		static bool valid(const VecLoop &loop){
+			if (!valid(loop.dst))
+				return false;
+			int32_t depth = 0;
+			for (const VecOp &op : loop.ops){
+				if (op.op <= VEC_LOAD)
+					depth++;
+				else if (op.op != VEC_NEG)
+					depth--;
+				if (depth < 1 || depth > vec::MaxDepth || (op.op == VEC_LOAD && !valid(op.kind)))
+					return false;
+			}
+			return depth == 1;
+		}
+
+		static bool valid(const BCProgram &prog, const BCFunction &fn, const Insn &insn){
+			auto reg = [&](int64_t r){ return r >= 0 && r < fn.numRegs; };
+			auto target = [&](int64_t pc){ return pc >= 0 && pc < (int64_t)fn.code.size(); };
+			switch (insn.op){
+			case OP_LOADI: case OP_GET: case OP_PRINT: case OP_FREE: case OP_RET:
+				return reg(insn.a);
+			case OP_MOV: case OP_NEG: case OP_NOT: case OP_LNOT: case OP_JOIN:
+			case OP_ADDI: case OP_MULI:
+			case OP_LOAD_I8: case OP_LOAD_U8: case OP_LOAD_I16: case OP_LOAD_U16:
+			case OP_LOAD_I32: case OP_LOAD_U32: case OP_LOAD_I64:
+			case OP_STORE_I8: case OP_STORE_I16: case OP_STORE_I32: case OP_STORE_I64:
+				return reg(insn.a) && reg(insn.b);
+			case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+			case OP_LT: case OP_GT: case OP_EQ: case OP_LE: case OP_GE:
+			case OP_LDELEM_I8: case OP_LDELEM_U8: case OP_LDELEM_I16: case OP_LDELEM_U16:
+			case OP_LDELEM_I32: case OP_LDELEM_U32: case OP_LDELEM_I64:
+			case OP_STELEM_I8: case OP_STELEM_I16: case OP_STELEM_I32: case OP_STELEM_I64:
+			case OP_XADD_I32: case OP_XADD_I64:
+				return reg(insn.a) && reg(insn.b) && reg(insn.c);
+			case OP_CAS_I32: case OP_CAS_I64:
+				return reg(insn.a) && reg(insn.b) && reg(insn.c) && reg((int64_t)insn.c + 1);
+			case OP_LOADK:
+				return reg(insn.a) && insn.b >= 0 && insn.b < (int64_t)prog.constants.size();
+			case OP_GETG:
+				return reg(insn.a) && insn.b >= 0 && insn.b < prog.numGlobals;
+			case OP_SETG:
+				return insn.a >= 0 && insn.a < prog.numGlobals && reg(insn.b);
+			case OP_ALLOCA:
+				return reg(insn.a) && insn.b >= 0 && insn.c >= 0 && (int64_t)insn.b + insn.c <= fn.arrayBytes;
+			case OP_JMP:
+				return target(insn.a);
+			case OP_JZ: case OP_JNZ:
+				return reg(insn.a) && target(insn.b);
+			case OP_JLTI: case OP_JGTI: case OP_JEQI: case OP_JNEI:
+				return reg(insn.a) && target(insn.c);
+			case OP_JLT: case OP_JLE: case OP_JEQ: case OP_JNE:
+				return reg(insn.a) && reg(insn.b) && target(insn.c);
+			case OP_VLOOP:{
+				if (insn.a < 0 || insn.a >= (int64_t)prog.vecLoops.size() || !reg(insn.b))
+					return false;
+				const VecLoop &loop = prog.vecLoops[insn.a];
+				if (!reg(loop.array) || !reg(loop.index))
+					return false;
+				for (const VecOp &op : loop.ops)
+					if ((op.op == VEC_SCALAR || op.op == VEC_LOAD) && !reg(op.operand))
+						return false;
+				return true;
+			}
+			case OP_CALL:
+				return reg(insn.a) && insn.b >= 0 && insn.b < (int64_t)prog.functions.size() && insn.c >= 0
+				    && (int64_t)insn.c + prog.functions[insn.b].numParams <= fn.numRegs;
+			// The thread's one argument is all its function gets
+			case OP_SPAWN:
+				return reg(insn.a) && insn.b >= 0 && insn.b < (int64_t)prog.functions.size()
+				    && prog.functions[insn.b].numParams <= 1 && reg(insn.c);
+			case OP_MALLOC:
+				return reg(insn.a) && reg(insn.b) && insn.c >= 0 && insn.c < (int64_t)prog.allocSites.size();
+			case OP_SNAPSHOT:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+	private:
+		int64_t get(){
+			int64_t val = 0;
+			if (mData.size() < sizeof(val)){
+				mOk = false;
+				mData = llvm::StringRef();
+				return 0;
+			}
+			memcpy(&val, mData.data(), sizeof(val));
+			mData = mData.drop_front(sizeof(val));
+			return val;
+		}
+		/// Every element takes at least 8 bytes, which bounds counts by the data left
+		size_t count(){
+			int64_t n = get();
+			if (n < 0 || (uint64_t)n > mData.size() / sizeof(int64_t)){
+				mOk = false;
+				mData = llvm::StringRef();
+				return 0;
+			}
+			return n;
+		}
+		std::string str(){
+			int64_t n = get();
+			if (n < 0 || (uint64_t)n > mData.size()){
+				mOk = false;
+				mData = llvm::StringRef();
+				return "";
+			}
+			std::string s = mData.take_front(n).str();
+			mData = mData.drop_front(n);
+			return s;
+		}
+	};
+};
@@ -1,4 +1,6 @@
+#pragma once
 #include <stdio.h>
+#include <string.h>
 #include <iostream>
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/Decl.h"
@@ -6,18 +8,42 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "ExecStats.h"
+#include "GuestExit.h"
+#include "GuestHeap.h"
+#include "GuestIO.h"
+#include "GuestMemory.h"
+#include "GuestStack.h"
+#include "GuestThreads.h"
+#include "MemoTable.h"
+#include "Profiler.h"
+#include "Purity.h"
+#include "SlotMap.h"
+#include "VectorLoops.h"
 
 using namespace clang;
 using namespace std;
 class StackFrame{
 	/// StackFrame maps Variable Declaration to Value
 	/// Which are either integer or addresses (also represented using an Integer value)
-	std::map<Decl *, int64_t> mVars; 
-	std::map<Stmt *, int64_t> mExprs;
+	/// Variables are addressed by the slot numbers SlotMap assigned them.
+	/// The frame itself lives on the host; its slots and local arrays are
+	/// its slice of the GuestStack, so no guest store can reach mCaller.
+	StackFrame *mCaller;
+	int64_t *mSlots;
+	int32_t mNumSlots;
 	int64_t retValue = 0;
 
 public:
-	StackFrame() : mVars(), mExprs(){
+	StackFrame() : mCaller(NULL), mSlots(NULL), mNumSlots(0){
+	}
+	StackFrame(StackFrame *caller, int64_t *slots, int32_t numSlots) : mCaller(caller), mSlots(slots), mNumSlots(numSlots){
+	}
+	static size_t bytes(int32_t numSlots, int64_t arrayBytes){
+		return numSlots * sizeof(int64_t) + arrayBytes;
+	}
+	StackFrame *getCaller(){
+		return mCaller;
 	}
 	void setReturn(int64_t val){		
 		retValue = val;
@@ -25,39 +51,239 @@ public:
 	int64_t getReturn(){
 		return retValue;
 	}
-	void bindDecl(Decl *decl, int64_t val){
-		mVars[decl] = val;
-	}
-	int64_t getDeclVal(Decl *decl){
-		assert(mVars.find(decl) != mVars.end());
-		return mVars.find(decl)->second;
+	int64_t *slots(){
+		return mSlots;
 	}
-	void bindStmt(Stmt *stmt, int64_t val){
-		mExprs[stmt] = val;
+	int64_t &slot(int32_t index){
+		assert(index < mNumSlots);
+		return mSlots[index];
 	}
-	int64_t getStmtVal(Stmt *stmt){
-		assert(mExprs.find(stmt) != mExprs.end());
-		return mExprs[stmt];
+	/// Local arrays, laid out by SlotMap after the slots
+	char *arrays(){
+		return (char *)(mSlots + mNumSlots);
 	}
+};
+
 
+class Environment;
+
+/// Executes function bodies on behalf of Environment::call
+class StmtRunner{
+public:
+	virtual ~StmtRunner() {}
+	virtual void runBody(Stmt *body) = 0;
+	/// A runner of its own for the Environment of a guest thread
+	virtual std::unique_ptr<StmtRunner> forThread(Environment &env) = 0;
 };
 
 
 class Environment{
+	/// What a call expression does, worked out once by init
+	enum class CallKind { Input, Output, Malloc, Free, Snapshot, Spawn, Join, AtomicAdd, AtomicCas, Guest, Undefined };
+	struct CallSite{
+		CallKind kind;
+		/// Guest calls and SPAWN: the definition, the frame it needs and
+		/// whether its results may be memoized
+		FunctionDecl *callee;
+		int32_t numSlots;
+		int64_t arrayBytes;
+		bool pure;
+		/// MALLOC: the heap site
+		int32_t allocSite;
+		/// Guest calls and SPAWN: the callee's index in mFunctions
+		int32_t function;
+	};
+
+	/// What running on this engine takes besides init's analysis. start()
+	/// builds it, so a program the VM runs reserves no memory here.
+	struct Memory{
+		GuestMemory memory;
+		GuestHeap heap;
+		/// Joins every thread before the rest goes away
+		GuestThreads threads;
+		Memory(size_t stackBytes, int32_t numThreads)
+		    : memory(stackBytes, GuestMemory::HeapReserve, NULL, numThreads), heap(memory), threads(memory, memory.stackBytes(1)){
+		}
+	};
+
+	/// What the threads of one program share. The Environment main runs
+	/// in owns it; the Environments SPAWN creates refer to their parent's.
+	/// Nothing init and start() work out changes afterwards.
+	struct Shared{
+		size_t stackBytes;
+		SlotMap slots;
+		std::vector<int64_t> globals;
+		llvm::DenseMap<const CallExpr *, CallSite> callSites;
+		/// MALLOC's sites by CallSite::allocSite, for the heap start() makes
+		std::vector<std::string> allocSites;
+		PurityAnalysis purity;
+		VectorLoops vectorLoops;
+		/// Last, so its threads are joined before the rest goes away
+		std::unique_ptr<Memory> memory;
+		explicit Shared(size_t stackBytes) : stackBytes(stackBytes){
+		}
+	};
+	std::unique_ptr<Shared> mOwned;
+
 	FunctionDecl *mFree; 
 	FunctionDecl *mMalloc;
 	FunctionDecl *mInput;
 	FunctionDecl *mOutput;
+	FunctionDecl *mSnapshot;
+	FunctionDecl *mSpawn;
+	FunctionDecl *mJoin;
+	FunctionDecl *mAtomicAdd;
+	FunctionDecl *mAtomicCas;
 	FunctionDecl *mEntry;
+	StmtRunner *mRunner;
+	SlotMap &mSlots;
+	std::vector<int64_t> &mGlobals;
+
+	/// NULL until start()
+	GuestMemory *mMemory;
+	std::unique_ptr<GuestStack> mStack;
+	/// The frame main, or the function a thread was spawned to run, runs
+	/// in, at the bottom of the guest stack
+	StackFrame mMain;
+	StackFrame *mFrame;
+	/// Lowest host stack address a guest call may start from, if known
+	const char *mHostLimit;
+
+	GuestHeap *mHeap;
+	GuestThreads *mThreads;
+	const SourceManager *mSources;
+
+	llvm::DenseMap<const CallExpr *, CallSite> &mCallSites;
+
+	/// Where GET reads and PRINT writes; each run has its own
+	GuestIO *mIO;
+
+	/// NULL unless profiling
+	Profiler *mProfiler;
+	llvm::DenseMap<const FunctionDecl *, int32_t> mProfileIds;
+
+	PurityAnalysis &mPurity;
+	/// NULL unless memoizing calls to pure functions
+	MemoTable *mMemo;
+	llvm::DenseMap<const FunctionDecl *, int32_t> mMemoIds;
+
+	/// Function definitions in the order of the source, which CallSites
+	/// refer to by index; only main's Environment has them
+	std::vector<FunctionDecl *> mFunctions;
+	llvm::DenseMap<const FunctionDecl *, int32_t> mFunctionIds;
+	/// NULL unless counting for --stats; the counters are this thread's
+	ExecStats *mExecStats;
+	ThreadStats *mStats;
+
+	/// Loops run by runVecLoop; none when vectorizing is off
+	bool mVectorize;
+	VectorLoops &mVectorLoops;
 
 public:
-	std::vector<StackFrame> mStack;
+	explicit Environment(size_t stackBytes = GuestStack::DefaultReserve) : mOwned(new Shared(stackBytes)), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mSnapshot(NULL), mSpawn(NULL), mJoin(NULL), mAtomicAdd(NULL), mAtomicCas(NULL), mEntry(NULL), mRunner(NULL),
+	      mSlots(mOwned->slots), mGlobals(mOwned->globals), mMemory(NULL), mFrame(NULL), mHostLimit(NULL), mHeap(NULL), mThreads(NULL), mSources(NULL),
+	      mCallSites(mOwned->callSites), mIO(NULL), mProfiler(NULL), mPurity(mOwned->purity), mMemo(NULL), mExecStats(NULL), mStats(NULL), mVectorize(true), mVectorLoops(mOwned->vectorLoops){
+	}
 
-	Environment() : mStack(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL){
+	/// The Environment of a guest thread SPAWN starts while parent runs. It
+	/// shares everything with parent but the stack of thread's slot, and
+	/// is neither profiled nor memoized. spawn() sets up its counters.
+	Environment(Environment &parent, int32_t thread) : mFree(parent.mFree), mMalloc(parent.mMalloc), mInput(parent.mInput), mOutput(parent.mOutput), mSnapshot(parent.mSnapshot), mSpawn(parent.mSpawn), mJoin(parent.mJoin),
+	      mAtomicAdd(parent.mAtomicAdd), mAtomicCas(parent.mAtomicCas), mEntry(parent.mEntry), mRunner(NULL), mSlots(parent.mSlots), mGlobals(parent.mGlobals), mMemory(parent.mMemory), mStack(new GuestStack(*mMemory, thread)), mFrame(NULL),
+	      mHostLimit(NULL), mHeap(parent.mHeap), mThreads(parent.mThreads), mSources(parent.mSources), mCallSites(parent.mCallSites), mIO(parent.mIO), mProfiler(NULL), mPurity(parent.mPurity), mMemo(NULL),
+	      mExecStats(parent.mExecStats), mStats(NULL), mVectorize(parent.mVectorize), mVectorLoops(parent.mVectorLoops){
 	}
 
-	void init(TranslationUnitDecl *unit){
-		mStack.push_back(StackFrame()); 
+	void setRunner(StmtRunner *runner){
+		mRunner = runner;
+	}
+	/// Takes effect at init
+	void setVectorize(bool on){
+		mVectorize = on;
+	}
+	void setHostLimit(const char *limit){
+		mHostLimit = limit;
+	}
+	void setIO(GuestIO &io){
+		mIO = &io;
+	}
+	void setProfiler(Profiler *profiler){
+		mProfiler = profiler;
+	}
+	Profiler *getProfiler(){
+		return mProfiler;
+	}
+	void setMemo(MemoTable *memo){
+		mMemo = memo;
+	}
+	bool isPure(const FunctionDecl *fdecl) const{
+		return mPurity.isPure(fdecl);
+	}
+	/// How forstmt runs as a vector loop, or NULL
+	const VecPlan *vectorPlan(const ForStmt *forstmt) const{
+		return mVectorLoops.lookup(forstmt);
+	}
+
+	/// Runs the rest of forstmt, whose init has run, if it is a vector loop
+	bool runVectorLoop(const ForStmt *forstmt){
+		const VecPlan *plan = mVectorLoops.lookup(forstmt);
+		if (!plan)
+			return false;
+		runVecLoop(plan->loop, mFrame->slots(), get_exprval(plan->bound), *mMemory);
+		return true;
+	}
+	int32_t profileId(const FunctionDecl *fdecl){
+		auto id = mProfileIds.find(fdecl->getDefinition());
+		if (id == mProfileIds.end())
+			id = mProfileIds.insert({fdecl->getDefinition(), mProfiler->addFunction(fdecl->getNameAsString())}).first;
+		return id->second;
+	}
+	/// Counts a statement starting, when profiling or counting. Expressions
+	/// are counted as get_exprval evaluates them.
+	void countLine(Stmt *stmt){
+		if (mProfiler)
+			mProfiler->line(lineOf(stmt));
+		if (mStats && !isa<Expr>(stmt))
+			countNode(stmt);
+	}
+	void countNode(Stmt *stmt){
+		if (mStats)
+			mStats->nodes[stmt->getStmtClass()].add();
+	}
+	/// Every variable read is a DeclRefExpr get_exprval evaluates, so both
+	/// are counted behind one check
+	void countExpr(Expr *expr){
+		mStats->nodes[expr->getStmtClass()].add();
+		if (isa<DeclRefExpr>(expr))
+			mStats->varReads.add();
+	}
+
+	/// Counts the nodes this thread visits by class, and what it calls.
+	/// main's call, the frames init pushed for it and the global arrays, and
+	/// those arrays' bytes are counted here.
+	void setStats(ExecStats *stats){
+		std::vector<std::string> nodes(Stmt::lastStmtConstant + 1, "?");
+#define STMT(CLASS, PARENT) nodes[Stmt::CLASS##Class] = #CLASS;
+#define ABSTRACT_STMT(STMT)
+#include "clang/AST/StmtNodes.inc"
+		std::vector<std::string> functions;
+		for (FunctionDecl *fdecl : mFunctions)
+			functions.push_back(fdecl->getNameAsString());
+		stats->setEngine("ast", std::move(nodes), std::move(functions));
+		mExecStats = stats;
+		mStats = stats->addThread();
+		if (mEntry)
+			mStats->calls[mFunctionIds[mEntry->getDefinition()]].add();
+		mStats->pushFrame();
+		mStats->pushFrame();
+		mStats->arrayBytes.add(mSlots.globalArrayBytes());
+	}
+	int32_t lineOf(Stmt *stmt){
+		return mSources->getPresumedLineNumber(stmt->getBeginLoc());
+	}
+
+	void init(TranslationUnitDecl *unit, const SourceManager &sources){
+		mSources = &sources;
 		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
 			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)){
 				if (fdecl->getName().equals("FREE"))
@@ -68,88 +294,236 @@ public:
 					mInput = fdecl;
 				else if (fdecl->getName().equals("PRINT"))
 					mOutput = fdecl;
+				else if (fdecl->getName().equals("SNAPSHOT"))
+					mSnapshot = fdecl;
+				else if (fdecl->getName().equals("SPAWN"))
+					mSpawn = fdecl;
+				else if (fdecl->getName().equals("JOIN"))
+					mJoin = fdecl;
+				else if (fdecl->getName().equals("ATOMIC_ADD"))
+					mAtomicAdd = fdecl;
+				else if (fdecl->getName().equals("ATOMIC_CAS"))
+					mAtomicCas = fdecl;
 				else if (fdecl->getName().equals("main"))
 					mEntry = fdecl;
 			}
+		}
+		mSlots.assign(unit);
+		mPurity.analyze(unit);
+		if (mVectorize)
+			mVectorLoops.analyze(unit, mSlots);
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)){
+				if (fdecl->doesThisDeclarationHaveABody()){
+					mFunctionIds[fdecl] = mFunctions.size();
+					mFunctions.push_back(fdecl);
+				}
+			}
+		}
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)){
+				if (fdecl->doesThisDeclarationHaveABody())
+					classifyCalls(fdecl->getBody());
+			}
 			else if (VarDecl *vardecl = dyn_cast<VarDecl>(*i)){
-					if (vardecl->hasInit())
-						mStack.back().bindDecl(vardecl, get_exprval(vardecl->getInit()));
-					else
-						mStack.back().bindDecl(vardecl, 0);
+				if (vardecl->hasInit())
+					classifyCalls(vardecl->getInit());
 			}
 		}
 	}
 
+	/// Reserves guest memory, then lays out and initializes the globals and
+	/// main's frame; the AST engine's part of init
+	void start(TranslationUnitDecl *unit){
+		mOwned->memory.reset(new Memory(mOwned->stackBytes, mSpawn ? GuestMemory::MaxThreads : 0));
+		mMemory = &mOwned->memory->memory;
+		mHeap = &mOwned->memory->heap;
+		mThreads = &mOwned->memory->threads;
+		mStack.reset(new GuestStack(*mMemory));
+		for (const std::string &site : mOwned->allocSites)
+			mHeap->addSite(site);
+		mGlobals.assign(mSlots.numGlobals(), 0);
+		/// Global arrays are laid out back to back at the bottom of the
+		/// stack, below main's frame, so they outlast it as they do in the
+		/// VM's <init> frame
+		char *globalArrays = (char *)mStack->pushFrame(mSlots.globalArrayBytes());
+		if (mEntry)
+			mMain = newFrame(mSlots.frameSize(mEntry), mSlots.frameArrayBytes(mEntry));
+		mFrame = &mMain;
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(*i)){
+				if (vardecl->getType()->isArrayType()){
+					char *array = globalArrays + mSlots.lookup(vardecl)->arrayOffset;
+					GuestStack::zero(array, SlotMap::arrayBytes(vardecl));
+					bindDecl(vardecl, (int64_t)array);
+				}
+				else if (vardecl->hasInit())
+					bindDecl(vardecl, get_exprval(vardecl->getInit()));
+				else
+					bindDecl(vardecl, 0);
+			}
+		}
+	}
+
+	const SlotMap &getSlots(){
+		return mSlots;
+	}
+	const GuestStack &getStack(){
+		return *mStack;
+	}
+	const GuestHeap &getHeap(){
+		return *mHeap;
+	}
+
+	/// Once main has returned, waits for the guest threads nobody joined
+	void joinThreads(){
+		mThreads->joinAll();
+	}
+
+	/// Names a MALLOC call by its position in the source, for heap reports
+	std::string allocSiteName(const CallExpr *callexpr){
+		PresumedLoc loc = mSources->getPresumedLoc(callexpr->getBeginLoc());
+		if (loc.isInvalid())
+			return "<unknown>";
+		return std::string(loc.getFilename()) + ":" + std::to_string(loc.getLine()) + ":" + std::to_string(loc.getColumn());
+	}
+
+	/// A frame called from the current one, its slots zeroed on top of
+	/// the stack; it becomes current once mFrame points at it
+	StackFrame newFrame(int32_t numSlots, int64_t arrayBytes){
+		int64_t *slots = (int64_t *)mStack->pushFrame(StackFrame::bytes(numSlots, arrayBytes));
+		if (mStats)
+			mStats->pushFrame();
+		memset(slots, 0, numSlots * sizeof(int64_t));
+		return StackFrame(mFrame, slots, numSlots);
+	}
+
+	/// Storage of a variable: a global, or a slot of the current frame.
+	/// Clang's nodes have no room for the slot, so every access still
+	/// probes mSlots once; the VM's registers are resolved when lowering.
+	int64_t &var(Decl *decl){
+		const VarSlot *slot = mSlots.lookup(decl);
+		assert(slot);
+		if (slot->global)
+			return mGlobals[slot->index];
+		return mFrame->slot(slot->index);
+	}
+	void bindDecl(Decl *decl, int64_t val){
+		if (mStats)
+			mStats->varWrites.add();
+		var(decl) = val;
+	}
+	int64_t getDeclVal(Decl *decl){
+		return var(decl);
+	}
+
 	FunctionDecl *getEntry(){
 		return mEntry;
 	}
+	FunctionDecl *getFree(){
+		return mFree;
+	}
+	FunctionDecl *getMalloc(){
+		return mMalloc;
+	}
+	FunctionDecl *getInput(){
+		return mInput;
+	}
+	FunctionDecl *getOutput(){
+		return mOutput;
+	}
+	FunctionDecl *getSnapshot(){
+		return mSnapshot;
+	}
+	FunctionDecl *getSpawn(){
+		return mSpawn;
+	}
+	FunctionDecl *getJoin(){
+		return mJoin;
+	}
+	FunctionDecl *getAtomicAdd(){
+		return mAtomicAdd;
+	}
+	FunctionDecl *getAtomicCas(){
+		return mAtomicCas;
+	}
+
+	/// The function SPAWN(fn, arg) names: a definition taking one parameter, or NULL
+	static FunctionDecl *spawnTarget(CallExpr *callexpr){
+		if (callexpr->getNumArgs() != 2)
+			return NULL;
+		DeclRefExpr *ref = dyn_cast<DeclRefExpr>(callexpr->getArg(0)->IgnoreParenImpCasts());
+		FunctionDecl *fdecl = ref ? dyn_cast<FunctionDecl>(ref->getDecl()) : NULL;
+		if (!fdecl || !fdecl->getDefinition() || fdecl->getNumParams() != 1)
+			return NULL;
+		return fdecl->getDefinition();
+	}
 
-	void binop(BinaryOperator *bop){
+	int64_t binop(BinaryOperator *bop){
 		Expr *left = bop->getLHS();
 		Expr *right = bop->getRHS();
-		int64_t rightval=get_exprval(right);
+		/// Left to right, as the VM does: an element's base and index, or a
+		/// pointer, before the value stored through it
 		if (bop->isAssignmentOp()){
 			if (DeclRefExpr *declexpr = dyn_cast<DeclRefExpr>(left)){
-				Decl *decl = declexpr->getFoundDecl();
-				mStack.back().bindDecl(decl, rightval);
+				int64_t rightval = get_exprval(right);
+				bindDecl(declexpr->getFoundDecl(), rightval);
+				return rightval;
 			}
-			else if(isa<ArraySubscriptExpr>(left)){
-				auto array = dyn_cast<ArraySubscriptExpr>(left);
-				int64_t indexval = get_exprval(array->getIdx());
-				DeclRefExpr *declexpr = dyn_cast<DeclRefExpr>(array->getLHS()->IgnoreImpCasts());
-				auto vardecl = dyn_cast<VarDecl>(declexpr->getFoundDecl());
-				auto arr = dyn_cast<ConstantArrayType>(vardecl->getType().getTypePtr());
-				if (arr->getElementType().getTypePtr()->isIntegerType())
-					*((int *)mStack.back().getDeclVal(vardecl) + indexval) = rightval;
-				else if (arr->getElementType().getTypePtr()->isCharType())
-					*((char *)mStack.back().getDeclVal(vardecl) + indexval) = (char)rightval;
-				else
-					*((int64_t **)mStack.back().getDeclVal(vardecl) + indexval) = (int64_t *)rightval;
+			else if (auto array = dyn_cast<ArraySubscriptExpr>(left)){
+				int64_t base = get_exprval(array->getBase());
+				int64_t index = get_exprval(array->getIdx());
+				int64_t rightval = get_exprval(right);
+				mMemory->store(SlotMap::elemKind(array->getType()), base, index, rightval);
+				return rightval;
 			}
-			else if (auto unaryExpr = dyn_cast<UnaryOperator>(left))
-				*((int64_t*)get_exprval(unaryExpr->getSubExpr()))=rightval;
+			else if (auto unaryExpr = dyn_cast<UnaryOperator>(left)){
+				int64_t addr = get_exprval(unaryExpr->getSubExpr());
+				int64_t rightval = get_exprval(right);
+				mMemory->store(SlotMap::elemKind(unaryExpr->getType()), addr, 0, rightval);
+				return rightval;
+			}
+			return get_exprval(right);
 		}
 		else{
 			auto op = bop->getOpcode();
 			int64_t leftval = get_exprval(left);
+			int64_t rightval = get_exprval(right);
 			switch (op){
 			case BO_Add: // +
-				if (left->getType().getTypePtr()->isPointerType())
-					mStack.back().bindStmt(bop, leftval + sizeof(int64_t) * rightval);
-				else
-					mStack.back().bindStmt(bop, leftval + rightval);
-				break;
+				if (isPointer(left))
+					return leftval + elemBytes(SlotMap::pointeeKind(left)) * rightval;
+				if (isPointer(right))
+					return leftval * elemBytes(SlotMap::pointeeKind(right)) + rightval;
+				return leftval + rightval;
 			case BO_Sub: // -
-				mStack.back().bindStmt(bop, leftval - rightval);
-				break;
+				if (isPointer(left) && isPointer(right))
+					return (leftval - rightval) / elemBytes(SlotMap::pointeeKind(left));
+				if (isPointer(left))
+					return leftval - elemBytes(SlotMap::pointeeKind(left)) * rightval;
+				return leftval - rightval;
 			case BO_Mul: // *
-				mStack.back().bindStmt(bop, leftval * rightval);
-				break;
+				return leftval * rightval;
 			case BO_Div:
-				if (rightval == 0)
-					cout << "error! can't div 0 " << endl;
-				exit(0);
-				mStack.back().bindStmt(bop, int64_t(leftval / rightval));
-				break;
+				if (rightval == 0){
+					guestError("can't div 0 ");
+				}
+				/// INT64_MIN / -1 wraps, as + - * do, instead of trapping
+				if (rightval == -1)
+					return (int64_t)(0 - (uint64_t)leftval);
+				return int64_t(leftval / rightval);
 			case BO_LT: // <
-				mStack.back().bindStmt(bop, leftval < rightval);
-				break;
+				return leftval < rightval;
 			case BO_GT: // >
-				mStack.back().bindStmt(bop, leftval > rightval);
-				break;
+				return leftval > rightval;
 			case BO_EQ: // ==
-				mStack.back().bindStmt(bop, leftval == rightval);
-				break;
+				return leftval == rightval;
 			case BO_LE:
-				mStack.back().bindStmt(bop,leftval<=rightval);
-				break;
+				return leftval<=rightval;
 			case BO_GE:
-				mStack.back().bindStmt(bop,leftval>=rightval);
-				break;
+				return leftval>=rightval;
 			default:
-				cout << "error! Can't handle this BinaryOp" << endl;
-				exit(0);
-				break;
+				guestError("Can't handle this BinaryOp");
 			}		
 		}
 	}
@@ -162,163 +536,299 @@ public:
 				QualType type = vardecl->getType();
 				if (type->isIntegerType() || type->isPointerType()){
 					if (vardecl->hasInit())
-						mStack.back().bindDecl(vardecl, get_exprval(vardecl->getInit()));
+						bindDecl(vardecl, get_exprval(vardecl->getInit()));
 					else
-						mStack.back().bindDecl(vardecl, 0);
+						bindDecl(vardecl, 0);
 				}
 				else if(type->isArrayType()) {
-						auto array = dyn_cast<ConstantArrayType>(type.getTypePtr());
-						int64_t len = array->getSize().getSExtValue();
-						if (array->getElementType().getTypePtr()->isIntegerType()){
-							int *arraystore = new int[len];
-							for (int i = 0; i < len; i++)
-								arraystore[i] = 0;
-							mStack.back().bindDecl(vardecl, (int64_t)arraystore);
-						}
-						else if (array->getElementType().getTypePtr()->isCharType()){
-							char *arraystore = new char[len];
-							for (int i = 0; i < len; i++)
-								arraystore[i] = 0;
-							mStack.back().bindDecl(vardecl, (int64_t)arraystore);
-						}
-						else{
-							int64_t **arraystore = new int64_t *[len];
-							for (int i = 0; i < len; i++)
-								arraystore[i] = 0;
-							mStack.back().bindDecl(vardecl, (int64_t)arraystore);
-						}
+						/// Arrays live in the frame and are released when it returns
+						const VarSlot *slot = mSlots.lookup(vardecl);
+						char *arraystore = mFrame->arrays() + slot->arrayOffset;
+						GuestStack::zero(arraystore, SlotMap::arrayBytes(vardecl));
+						if (mStats)
+							mStats->arrayBytes.add(SlotMap::arrayBytes(vardecl));
+						bindDecl(vardecl, (int64_t)arraystore);
 				}
 			}
 		}
 	}
 
 	void returnstmt(ReturnStmt *returnStmt){
-		mStack.back().setReturn(get_exprval(returnStmt->getRetValue()));
+		mFrame->setReturn(get_exprval(returnStmt->getRetValue()));
 	}
 		
 	
 
-	void unaryop(UnaryOperator *uop){ // - +
+	int64_t unaryop(UnaryOperator *uop){ // - +
 		auto op = uop->getOpcode();
 		switch (op){
 		case UO_Minus:
-			mStack.back().bindStmt(uop, -1 * get_exprval(uop->getSubExpr()));
-			break;
+			return -1 * get_exprval(uop->getSubExpr());
 		case UO_Plus:
-			mStack.back().bindStmt(uop, get_exprval(uop->getSubExpr()));
-			break;
+			return get_exprval(uop->getSubExpr());
 		case UO_Not:
-			mStack.back().bindStmt(uop,~get_exprval(uop->getSubExpr()));
-			break;
+			return ~get_exprval(uop->getSubExpr());
 		case UO_LNot:
-			mStack.back().bindStmt(uop,!get_exprval(uop->getSubExpr()));
-			break;
+			return !get_exprval(uop->getSubExpr());
 		case UO_Deref: // '*'
-			mStack.back().bindStmt(uop, *(int64_t *)get_exprval(uop->getSubExpr()));
-			break;
+			return mMemory->load(SlotMap::elemKind(uop->getType()), get_exprval(uop->getSubExpr()), 0);
 		default:
-			cout << "error! can't process unaryOp " << endl;
-			exit(0);
-			break;
+			guestError("can't process unaryOp ");
 		}
 	}
 
-	void bind_paexprval(ParenExpr *parenexpr){
-		mStack.back().bindStmt(parenexpr,get_exprval(parenexpr->getSubExpr()));
-	}
-
+	/// Evaluates expr recursively; every sub-expression's value is returned
+	/// to its parent rather than stored in the frame
 	int64_t get_exprval(Expr *expr){
 		expr = expr->IgnoreImpCasts();
-		if (auto decl = dyn_cast<DeclRefExpr>(expr)){
-			declref(decl);
-			return (int64_t)mStack.back().getStmtVal(decl);
-		}
+		if (mStats)
+			countExpr(expr);
+		if (auto decl = dyn_cast<DeclRefExpr>(expr))
+			return declref(decl);
 		else if (auto intliteral = dyn_cast<IntegerLiteral>(expr)) 
 			return intliteral->getValue().getSExtValue();
 		else if (auto charliteral = dyn_cast<CharacterLiteral>(expr))
 			return charliteral->getValue(); 
-		else if (auto uop = dyn_cast<UnaryOperator>(expr)){ 
-			unaryop(uop);
-			return mStack.back().getStmtVal(uop);
-		}
-		else if (auto bop = dyn_cast<BinaryOperator>(expr)){ 
-			binop(bop);
-			return mStack.back().getStmtVal(bop);
-		}
+		else if (auto uop = dyn_cast<UnaryOperator>(expr))
+			return unaryop(uop);
+		else if (auto bop = dyn_cast<BinaryOperator>(expr))
+			return binop(bop);
 		else if (auto pexpr = dyn_cast<ParenExpr>(expr)) 
-			return mStack.back().getStmtVal(expr);
+			return get_exprval(pexpr->getSubExpr());
 		else if (auto array = dyn_cast<ArraySubscriptExpr>(expr))// a[1]
-			return mStack.back().getStmtVal(expr);
+			return arrayval(array);
 		else if (auto callexpr = dyn_cast<CallExpr>(expr))
-			return mStack.back().getStmtVal(callexpr);
+			return call(callexpr);
 		else if(auto sizeofexpr = dyn_cast<UnaryExprOrTypeTraitExpr>(expr))
-			return mStack.back().getStmtVal(sizeofexpr);
+			return ueot(sizeofexpr);
 		else if (auto castexpr = dyn_cast<CStyleCastExpr>(expr))
 			return get_exprval(castexpr->getSubExpr());
-		cout << "error! can't handle the expression" << endl;
+		mIO->error("can't handle the expression");
 		return 0;
 	}
-	void bind_array(ArraySubscriptExpr *arraysubscript){
-		int64_t indexval = get_exprval(arraysubscript->getIdx());
-		DeclRefExpr *declexpr = dyn_cast<DeclRefExpr>(arraysubscript->getLHS()->IgnoreImpCasts());
-		VarDecl *vardecl = dyn_cast<VarDecl>(declexpr->getFoundDecl());
-		auto arr = dyn_cast<ConstantArrayType>(vardecl->getType().getTypePtr());
-		if (arr->getElementType().getTypePtr()->isIntegerType())
-			mStack.back().bindStmt(arraysubscript,*((int *)mStack.back().getDeclVal(vardecl)+indexval));
-		else if(arr->getElementType().getTypePtr()->isCharType())
-			mStack.back().bindStmt(arraysubscript,*((char *)mStack.back().getDeclVal(vardecl)+indexval));
-		else	
-			mStack.back().bindStmt(arraysubscript,(int64_t)(*((int64_t **)mStack.back().getDeclVal(vardecl)+indexval)));
+	/// The element kind comes straight from the access's own type
+	int64_t arrayval(ArraySubscriptExpr *arraysubscript){
+		int64_t base = get_exprval(arraysubscript->getBase());
+		return mMemory->load(SlotMap::elemKind(arraysubscript->getType()), base, get_exprval(arraysubscript->getIdx()));
+	}
+	static bool isPointer(Expr *expr){
+		return expr->getType()->isPointerType() || expr->getType()->isArrayType();
 	}
 
-	void bind_ueot(UnaryExprOrTypeTraitExpr *ueotexpr){
+	int64_t ueot(UnaryExprOrTypeTraitExpr *ueotexpr){
 		UnaryExprOrTypeTrait kind = ueotexpr->getKind();
 		switch (kind)
 		{
 		case UETT_SizeOf:
-			mStack.back().bindStmt(ueotexpr, (int64_t)8);
-			break;
+			return (int64_t)8;
 		default:
 			llvm::errs() << "Unhandled UEOT.";
-			break;
+			return 0;
 		}
 	}
 
-	void declref(DeclRefExpr *declref){
+	int64_t declref(DeclRefExpr *declref){
 		if (declref->getType()->isIntegerType() || declref->getType()->isPointerType() || declref->getType()->isArrayType())
-			mStack.back().bindStmt(declref, mStack.back().getDeclVal(declref->getFoundDecl()));
-}
+			return getDeclVal(declref->getFoundDecl());
+		return 0;
+	}
 	
-void call(CallExpr *callexpr){
-		int64_t val = 0;
-		FunctionDecl *callee = callexpr->getDirectCallee();
-		if (callee == mInput)
-		{
-			cout << "Please Input an Integer Value : " << endl;
-			cin >> val;
-			mStack.back().bindStmt(callexpr, val);
+	int64_t call(CallExpr *callexpr){
+		auto found = mCallSites.find(callexpr);
+		assert(found != mCallSites.end());
+		CallSite &site = found->second;
+		switch (site.kind){
+		case CallKind::Input:
+			return mIO->get();
+		case CallKind::Output:
+			mIO->print(get_exprval(callexpr->getArg(0)));
+			return 0;
+		case CallKind::Malloc:{
+			int64_t size = get_exprval(callexpr->getArg(0));
+			void *block = mHeap->allocate(size, site.allocSite);
+			if (mStats)
+				mStats->mallocBytes.add(size);
+			return (int64_t)block;
 		}
-		else if (callee == mOutput){ 
-			Expr *decl = callexpr->getArg(0);
-			cout << get_exprval(decl) << endl;
+		case CallKind::Free:
+			mHeap->release((void *)get_exprval(callexpr->getArg(0)));
+			return 0;
+		/// Only the VM takes snapshots
+		case CallKind::Snapshot:
+			return 0;
+		case CallKind::Spawn:
+			return spawn(callexpr, site);
+		case CallKind::Join:
+			return mThreads->join(get_exprval(callexpr->getArg(0)));
+		case CallKind::AtomicAdd:{
+			bool wide = atomicWide(callexpr);
+			int64_t addr = get_exprval(callexpr->getArg(0));
+			int64_t val = get_exprval(callexpr->getArg(1));
+			return wide ? mMemory->fetchAdd<int64_t>(addr, val) : mMemory->fetchAdd<int32_t>(addr, val);
 		}
-		else if (callee == mMalloc){
-			int64_t malloc_size = get_exprval(callexpr->getArg(0));
-			int64_t *p = (int64_t *)std::malloc(malloc_size);
-			mStack.back().bindStmt(callexpr, (int64_t)p);
+		case CallKind::AtomicCas:{
+			bool wide = atomicWide(callexpr);
+			int64_t addr = get_exprval(callexpr->getArg(0));
+			int64_t expected = get_exprval(callexpr->getArg(1));
+			int64_t desired = get_exprval(callexpr->getArg(2));
+			return wide ? mMemory->compareExchange<int64_t>(addr, expected, desired) : mMemory->compareExchange<int32_t>(addr, expected, desired);
 		}
-		else if (callee == mFree){
-			int64_t *p = (int64_t *)get_exprval(callexpr->getArg(0));
-			std::free(p);
+		case CallKind::Guest:
+			return callGuest(callexpr, site);
+		default:{
+			FunctionDecl *callee = callexpr->getDirectCallee();
+			guestError("call to undefined function " + (callee ? callee->getNameAsString() : std::string("<indirect>")));
 		}
-		else{
-			vector<int64_t> args;
-			for (auto i = callexpr->arg_begin(); i != callexpr->arg_end(); i++)
-				args.push_back(get_exprval(*i));
-			mStack.push_back(StackFrame());
-			int j = 0;
-			for (auto i = callee->param_begin(); i !=callee->param_end(); i++, j++)
-				mStack.back().bindDecl(*i, args[j]);
 		}
 	}
-};
\ No newline at end of file
+
+private:
+	void classifyCalls(Stmt *stmt){
+		if (CallExpr *callexpr = dyn_cast<CallExpr>(stmt)){
+			FunctionDecl *callee = callexpr->getDirectCallee();
+			CallSite site = {CallKind::Undefined, NULL, 0, 0, false, -1, -1};
+			if (callee == mInput)
+				site.kind = CallKind::Input;
+			else if (callee == mOutput)
+				site.kind = CallKind::Output;
+			else if (callee == mMalloc){
+				site.kind = CallKind::Malloc;
+				site.allocSite = mOwned->allocSites.size();
+				mOwned->allocSites.push_back(allocSiteName(callexpr));
+			}
+			else if (callee == mFree)
+				site.kind = CallKind::Free;
+			else if (callee == mSnapshot)
+				site.kind = CallKind::Snapshot;
+			else if (callee == mSpawn){
+				site.kind = CallKind::Spawn;
+				site.callee = spawnTarget(callexpr);
+				if (site.callee){
+					site.numSlots = mSlots.frameSize(site.callee);
+					site.arrayBytes = mSlots.frameArrayBytes(site.callee);
+					site.function = mFunctionIds[site.callee];
+				}
+			}
+			else if (callee == mJoin)
+				site.kind = CallKind::Join;
+			else if (callee == mAtomicAdd)
+				site.kind = CallKind::AtomicAdd;
+			else if (callee == mAtomicCas)
+				site.kind = CallKind::AtomicCas;
+			else if (callee && callee->getDefinition()){
+				site.kind = CallKind::Guest;
+				site.callee = callee->getDefinition();
+				site.numSlots = mSlots.frameSize(site.callee);
+				site.arrayBytes = mSlots.frameArrayBytes(site.callee);
+				site.pure = isPure(site.callee) && MemoTable::fits(callexpr->getNumArgs());
+				site.function = mFunctionIds[site.callee];
+			}
+			mCallSites[callexpr] = site;
+		}
+		for (Stmt *child : stmt->children())
+			if (child)
+				classifyCalls(child);
+	}
+
+	/// Arguments are evaluated in the caller's frame straight into the
+	/// parameter slots of the callee's, which then becomes current
+	int64_t callGuest(CallExpr *callexpr, const CallSite &site){
+		/// Guest calls nest host frames here, so the host stack runs out
+		/// with the guest's
+		if ((const char *)__builtin_frame_address(0) < mHostLimit)
+			mStack->overflow();
+		if (mStats)
+			mStats->calls[site.function].add();
+		StackFrame frame = newFrame(site.numSlots, site.arrayBytes);
+		int64_t *params = frame.slots();
+		unsigned numArgs = callexpr->getNumArgs();
+		for (unsigned i = 0; i < numArgs; i++)
+			params[i] = get_exprval(callexpr->getArg(i));
+		int64_t val;
+		int32_t memoId = -1;
+		int64_t args[MemoTable::MaxArgs];
+		if (mMemo && site.pure){
+			memoId = memoIdOf(site.callee);
+			if (mMemo->lookup(memoId, params, numArgs, val)){
+				popFrame(params);
+				return val;
+			}
+			/// The callee may assign its parameters
+			memcpy(args, params, numArgs * sizeof(int64_t));
+		}
+		mFrame = &frame;
+		if (mProfiler)
+			mProfiler->enter(profileId(site.callee));
+		mRunner->runBody(site.callee->getBody());
+		if (mProfiler)
+			mProfiler->leave();
+		val = frame.getReturn();
+		mFrame = frame.getCaller();
+		popFrame(params);
+		if (memoId >= 0)
+			mMemo->store(memoId, args, numArgs, val);
+		return val;
+	}
+
+	/// SPAWN: the new thread gets an Environment and a runner of its own,
+	/// made here while this thread's are sure to be alive
+	int64_t spawn(CallExpr *callexpr, const CallSite &site){
+		if (!site.callee)
+			guestError("SPAWN needs a function of one parameter");
+		int64_t arg = get_exprval(callexpr->getArg(1));
+		mHeap->share();
+		mIO->share();
+		int32_t slot = mThreads->claim();
+		std::shared_ptr<Environment> thread = std::make_shared<Environment>(*this, slot);
+		std::shared_ptr<StmtRunner> runner = mRunner->forThread(*thread);
+		if (mExecStats)
+			thread->mStats = mExecStats->addThread();
+		CallSite entry = site;
+		return mThreads->start(slot, [thread, runner, entry, arg](const char *hostLimit){
+			thread->setHostLimit(hostLimit);
+			int64_t val = thread->runThread(entry, arg);
+			if (thread->mStats)
+				thread->mExecStats->retire(thread->mStats);
+			return val;
+		});
+	}
+
+	/// Runs the function a thread was spawned to run in its bottom frame
+	int64_t runThread(const CallSite &site, int64_t arg){
+		if (mStats)
+			mStats->calls[site.function].add();
+		mMain = newFrame(site.numSlots, site.arrayBytes);
+		mMain.slot(0) = arg;
+		mFrame = &mMain;
+		mRunner->runBody(site.callee->getBody());
+		return mMain.getReturn();
+	}
+
+	/// ATOMIC_ADD and ATOMIC_CAS work on int and long
+	static bool atomicWide(CallExpr *callexpr){
+		switch (SlotMap::pointeeKind(callexpr->getArg(0)->IgnoreParenImpCasts())){
+		case EK_I32:
+		case EK_U32:
+			return false;
+		case EK_I64:
+			return true;
+		default:{
+			FunctionDecl *callee = callexpr->getDirectCallee();
+			guestError(callee->getNameAsString() + " needs a pointer to int or long");
+		}
+		}
+	}
+
+	void popFrame(int64_t *slots){
+		mStack->popFrame(slots);
+		if (mStats)
+			mStats->popFrame();
+	}
+
+	int32_t memoIdOf(const FunctionDecl *fdecl){
+		auto id = mMemoIds.find(fdecl->getDefinition());
+		if (id == mMemoIds.end())
+			id = mMemoIds.insert({fdecl->getDefinition(), mMemo->addFunction(fdecl->getNameAsString())}).first;
+		return id->second;
+	}
+};
@@ -0,0 +1,246 @@
+#pragma once
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// A count that one thread bumps and any thread may read. Relaxed loads and
+/// stores compile to plain moves, so a bump costs what an increment of a
+/// plain integer does, with no locked instruction.
+class StatCounter{
+	std::atomic<uint64_t> mVal;
+
+public:
+	StatCounter() : mVal(0){
+	}
+	void add(uint64_t n = 1){
+		mVal.store(mVal.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	void set(uint64_t val){
+		mVal.store(val, std::memory_order_relaxed);
+	}
+	uint64_t get() const{
+		return mVal.load(std::memory_order_relaxed);
+	}
+};
+
+/// What one guest thread did. Each thread bumps counters of its own, so
+/// threads share nothing on the hot path.
+struct ThreadStats{
+	/// By AST node class or by opcode, whichever the engine runs
+	std::vector<StatCounter> nodes;
+	/// Calls by function
+	std::vector<StatCounter> calls;
+	StatCounter frames;
+	StatCounter peakDepth;
+	StatCounter varReads;
+	StatCounter varWrites;
+	/// Bytes of local arrays as their declarations run, and bytes MALLOC returned
+	StatCounter arrayBytes;
+	StatCounter mallocBytes;
+	/// Frames now on the thread's stack; only the thread reads it
+	uint64_t depth;
+
+	ThreadStats(size_t numNodes, size_t numFunctions) : nodes(numNodes), calls(numFunctions), depth(0){
+	}
+
+	void pushFrame(){
+		frames.add();
+		if (++depth > peakDepth.get())
+			peakDepth.set(depth);
+	}
+	/// A restored Snapshot's frames were pushed before counting began
+	void popFrame(){
+		if (depth)
+			depth--;
+	}
+};
+
+/// --stats: counters of one program run, written as a line of JSON when
+/// it ends. Every guest thread gets ThreadStats of its own from
+/// addThread(); those of finished threads are folded into one total. The
+/// programs running at any time can also be dumped from another thread,
+/// which is what dumpOnSignal() does.
+class ExecStats{
+	std::string mProgram;
+	std::string mEngine;
+	std::vector<std::string> mNodeNames;
+	std::vector<std::string> mFunctions;
+	std::chrono::steady_clock::time_point mStarted;
+	std::chrono::steady_clock::time_point mParsed;
+
+	std::mutex mLock;
+	std::vector<std::unique_ptr<ThreadStats>> mThreads;
+	std::unique_ptr<ThreadStats> mRetired;
+	uint64_t mNumThreads;
+
+	/// The ExecStats that exist, for dumpAll()
+	static std::mutex &registryLock(){
+		static std::mutex lock;
+		return lock;
+	}
+	static std::vector<ExecStats *> &registry(){
+		static std::vector<ExecStats *> all;
+		return all;
+	}
+
+public:
+	/// started is when the frontend began on the program, parsed when its
+	/// AST (or cached bytecode) was ready
+	ExecStats(const std::string &program, std::chrono::steady_clock::time_point started, std::chrono::steady_clock::time_point parsed)
+	    : mProgram(program), mStarted(started), mParsed(parsed), mNumThreads(0){
+		std::lock_guard<std::mutex> guard(registryLock());
+		registry().push_back(this);
+	}
+	~ExecStats(){
+		std::lock_guard<std::mutex> guard(registryLock());
+		registry().erase(std::find(registry().begin(), registry().end(), this));
+	}
+	ExecStats(const ExecStats &) = delete;
+	ExecStats &operator=(const ExecStats &) = delete;
+
+	/// Names what the engine counts, before any thread is added
+	void setEngine(const std::string &engine, std::vector<std::string> nodeNames, std::vector<std::string> functions){
+		std::lock_guard<std::mutex> guard(mLock);
+		mEngine = engine;
+		mNodeNames = std::move(nodeNames);
+		mFunctions = std::move(functions);
+		mRetired.reset(new ThreadStats(mNodeNames.size(), mFunctions.size()));
+	}
+
+	/// Counters for a thread about to start; retire() hands them back
+	ThreadStats *addThread(){
+		std::lock_guard<std::mutex> guard(mLock);
+		mThreads.emplace_back(new ThreadStats(mNodeNames.size(), mFunctions.size()));
+		mNumThreads++;
+		return mThreads.back().get();
+	}
+	void retire(ThreadStats *thread){
+		std::lock_guard<std::mutex> guard(mLock);
+		for (auto i = mThreads.begin(); i != mThreads.end(); ++i)
+			if (i->get() == thread){
+				addTo(*thread, *mRetired);
+				mThreads.erase(i);
+				return;
+			}
+	}
+
+	void write(llvm::raw_ostream &os){
+		typedef std::chrono::duration<double, std::milli> Ms;
+		std::lock_guard<std::mutex> guard(mLock);
+		ThreadStats total(mNodeNames.size(), mFunctions.size());
+		if (mRetired)
+			addTo(*mRetired, total);
+		for (const auto &thread : mThreads)
+			addTo(*thread, total);
+		os << "{\"program\": ";
+		writeString(os, mProgram);
+		os << ", \"engine\": ";
+		writeString(os, mEngine);
+		os << llvm::format(", \"parseMs\": %.3f, \"executeMs\": %.3f", Ms(mParsed - mStarted).count(),
+		                   Ms(std::chrono::steady_clock::now() - mParsed).count());
+		os << ", \"threads\": " << mNumThreads << ", \"nodes\": ";
+		writeCounts(os, mNodeNames, total.nodes);
+		os << ", \"calls\": ";
+		writeCounts(os, mFunctions, total.calls);
+		os << ", \"frames\": " << total.frames.get() << ", \"peakDepth\": " << total.peakDepth.get()
+		   << ", \"varReads\": " << total.varReads.get() << ", \"varWrites\": " << total.varWrites.get()
+		   << ", \"arrayBytes\": " << total.arrayBytes.get() << ", \"mallocBytes\": " << total.mallocBytes.get() << "}\n";
+	}
+
+	/// Writes the programs running now, as far as they have got
+	static void dumpAll(llvm::raw_ostream &os){
+		std::lock_guard<std::mutex> guard(registryLock());
+		for (ExecStats *stats : registry())
+			stats->write(os);
+		os.flush();
+	}
+
+	/// Has signo dump the running programs to stderr. The signal is blocked
+	/// here and taken by a thread of its own with sigwait, so nothing runs
+	/// in a signal handler; call this before starting any other thread, so
+	/// that they all inherit the mask.
+	static bool dumpOnSignal(int signo){
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, signo);
+		if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+			return false;
+		std::thread([set](){
+			for (;;){
+				int received;
+				if (sigwait(&set, &received) != 0)
+					continue;
+				// Written in one go, not through errs(), which running
+				// programs use unlocked and would interleave with
+				std::string dump;
+				llvm::raw_string_ostream os(dump);
+				dumpAll(os);
+				os.flush();
+				for (size_t done = 0; done < dump.size();){
+					ssize_t n = ::write(STDERR_FILENO, dump.data() + done, dump.size() - done);
+					if (n < 0 && errno == EINTR)
+						continue;
+					if (n <= 0)
+						break;
+					done += n;
+				}
+			}
+		}).detach();
+		return true;
+	}
+
+private:
+	/// The peak depth of several threads is the deepest any of them got
+	static void addTo(const ThreadStats &from, ThreadStats &to){
+		for (size_t i = 0; i < from.nodes.size(); i++)
+			to.nodes[i].add(from.nodes[i].get());
+		for (size_t i = 0; i < from.calls.size(); i++)
+			to.calls[i].add(from.calls[i].get());
+		to.frames.add(from.frames.get());
+		to.peakDepth.set(std::max(to.peakDepth.get(), from.peakDepth.get()));
+		to.varReads.add(from.varReads.get());
+		to.varWrites.add(from.varWrites.get());
+		to.arrayBytes.add(from.arrayBytes.get());
+		to.mallocBytes.add(from.mallocBytes.get());
+	}
+
+	/// An object of the nonzero counts, by name
+	static void writeCounts(llvm::raw_ostream &os, const std::vector<std::string> &names, const std::vector<StatCounter> &counts){
+		os << "{";
+		bool first = true;
+		for (size_t i = 0; i < counts.size(); i++){
+			if (!counts[i].get())
+				continue;
+			os << (first ? "" : ", ");
+			writeString(os, names[i]);
+			os << ": " << counts[i].get();
+			first = false;
+		}
+		os << "}";
+	}
+
+	static void writeString(llvm::raw_ostream &os, const std::string &str){
+		os << '"';
+		for (unsigned char c : str){
+			if (c == '"' || c == '\\')
+				os << '\\' << c;
+			else if (c < 0x20)
+				os << llvm::format("\\u%04x", c);
+			else
+				os << c;
+		}
+		os << '"';
+	}
+};
@@ -0,0 +1,13 @@
+#pragma once
+#include <string>
+
+/// Ends the running guest program with an error. Whoever runs the program
+/// catches it and reports "error! <message>" on the program's own output,
+/// so one failing program never takes a batch down with it.
+struct GuestExit{
+	std::string message;
+};
+
+[[noreturn]] inline void guestError(const std::string &message){
+	throw GuestExit{message};
+}
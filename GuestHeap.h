@@ -0,0 +1,323 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "GuestExit.h"
+#include "GuestStack.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Heap behind the MALLOC/FREE builtins, the upper part of GuestMemory.
+/// Small blocks come from per-size class freelists; bigger ones from
+/// power-of-two classes whose free blocks are listed outside guest memory.
+/// Every block carries a header naming its state and allocation site,
+/// which is enough to catch double and invalid frees and to attribute
+/// leaks. The guest can overwrite headers and freelist links, so they are
+/// checked before the heap relies on them. Once the program has started
+/// a guest thread, every call takes a lock.
+class GuestHeap{
+	struct Block{
+		uint32_t magic;
+		int32_t site;
+		int64_t size;
+	};
+	struct Site{
+		std::string name;
+		int64_t allocs;
+		int64_t bytes;
+		int64_t liveBlocks;
+		int64_t liveBytes;
+	};
+
+	static const uint32_t LiveMagic = 0x6c697665;
+	static const uint32_t FreeMagic = 0x66726565;
+	static const size_t Granule = 16;
+	static const size_t NumClasses = 16;
+	/// Freed large blocks at least this big give their pages back
+	static const size_t ReleaseBytes = 64 << 10;
+
+	/// Freed small blocks by class; the link lives in the payload
+	Block *mFree[NumClasses + 1];
+	char *mBase;
+	char *mBump;
+	char *mLimit;
+	/// Live large blocks and their classes (log2 of the block's bytes),
+	/// and freed ones by class
+	llvm::DenseMap<Block *, int32_t> mLarge;
+	std::vector<Block *> mLargeFree[64];
+	std::vector<Site> mSites;
+
+	int64_t mAllocs;
+	int64_t mFrees;
+	int64_t mLiveBlocks;
+	int64_t mLiveBytes;
+	int64_t mPeakBytes;
+
+	bool mShared;
+	std::mutex mLock;
+
+public:
+	explicit GuestHeap(GuestMemory &memory) : mAllocs(0), mFrees(0), mLiveBlocks(0), mLiveBytes(0), mPeakBytes(0), mShared(false){
+		for (size_t c = 0; c <= NumClasses; c++)
+			mFree[c] = NULL;
+		mBase = mBump = memory.heapBase();
+		mLimit = mBase + memory.heapBytes();
+	}
+	GuestHeap(const GuestHeap &) = delete;
+	GuestHeap &operator=(const GuestHeap &) = delete;
+
+	/// Registers an allocation site, named for the report
+	int32_t addSite(const std::string &name){
+		mSites.push_back(Site{name, 0, 0, 0, 0});
+		return mSites.size() - 1;
+	}
+
+	/// Called before a second guest thread starts
+	void share(){
+		mShared = true;
+	}
+
+	void *allocate(int64_t size, int32_t site){
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (mShared)
+			guard.lock();
+		if (size < 0){
+			guestError("bad malloc size " + std::to_string(size));
+		}
+		if ((uint64_t)size > (uint64_t)(mLimit - mBase)){
+			guestError("guest heap exhausted");
+		}
+		size_t cls = sizeClass(size);
+		Block *block;
+		if (cls <= NumClasses){
+			block = mFree[cls];
+			if (block){
+				Block *next = *(Block **)(block + 1);
+				if (next && (!inHeap(next) || next->magic != FreeMagic))
+					guestError("guest heap corrupted");
+				mFree[cls] = next;
+			}
+			else
+				block = (Block *)carve(sizeof(Block) + cls * Granule);
+		}
+		else{
+			int32_t large = largeClass(size);
+			if (!mLargeFree[large].empty()){
+				block = mLargeFree[large].back();
+				mLargeFree[large].pop_back();
+			}
+			else
+				block = (Block *)carve((size_t)1 << large);
+			mLarge[block] = large;
+		}
+		block->magic = LiveMagic;
+		block->site = site;
+		block->size = size;
+		mAllocs++;
+		mLiveBlocks++;
+		mLiveBytes += size;
+		if (mLiveBytes > mPeakBytes)
+			mPeakBytes = mLiveBytes;
+		if (site >= 0){
+			Site &s = mSites[site];
+			s.allocs++;
+			s.bytes += size;
+			s.liveBlocks++;
+			s.liveBytes += size;
+		}
+		return block + 1;
+	}
+
+	/// FREE(NULL) is a no-op, as in C
+	void release(void *ptr){
+		if (!ptr)
+			return;
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (mShared)
+			guard.lock();
+		Block *block = (Block *)ptr - 1;
+		/// Only headers inside the heap are read. Large blocks are known by
+		/// their address; one is forgotten once freed, so freeing it again
+		/// reads as an invalid free.
+		auto large = mLarge.find(block);
+		if ((uintptr_t)ptr % Granule != 0 || !inHeap(block))
+			invalidFree(ptr);
+		if (large == mLarge.end() && block->magic == FreeMagic){
+			guestError("double free of " + describe(ptr));
+		}
+		if (block->magic != LiveMagic || (large == mLarge.end() && sizeClass(block->size) > NumClasses))
+			invalidFree(ptr);
+		if (block->site < -1 || block->site >= (int32_t)mSites.size() || block->size < 0)
+			guestError("guest heap corrupted");
+		mFrees++;
+		mLiveBlocks--;
+		mLiveBytes -= block->size;
+		if (block->site >= 0){
+			Site &s = mSites[block->site];
+			s.liveBlocks--;
+			s.liveBytes -= block->size;
+		}
+		block->magic = FreeMagic;
+		if (large == mLarge.end()){
+			size_t cls = sizeClass(block->size);
+			*(Block **)(block + 1) = mFree[cls];
+			mFree[cls] = block;
+		}
+		else{
+			int32_t cls = large->second;
+			mLarge.erase(large);
+			mLargeFree[cls].push_back(block);
+			if (((size_t)1 << cls) >= ReleaseBytes)
+				GuestStack::zero(block + 1, ((size_t)1 << cls) - sizeof(Block));
+		}
+	}
+
+	int64_t liveBytes() const{
+		return mLiveBytes;
+	}
+
+	/// What a Snapshot keeps besides the blocks themselves, which it names
+	/// by their offset into the heap
+	struct State{
+		uint64_t bytesUsed;
+		/// Head of each small class's freelist, or -1
+		std::vector<int64_t> free;
+		/// Live and freed large blocks, with their classes
+		std::vector<std::pair<int64_t, int32_t>> large;
+		std::vector<std::pair<int64_t, int32_t>> largeFree;
+		/// Per site: allocations, bytes, live blocks and live bytes
+		std::vector<int64_t> sites;
+		int64_t allocs;
+		int64_t frees;
+		int64_t liveBlocks;
+		int64_t liveBytes;
+		int64_t peakBytes;
+	};
+
+	State state() const{
+		State state;
+		state.bytesUsed = mBump - mBase;
+		for (size_t c = 0; c <= NumClasses; c++)
+			state.free.push_back(mFree[c] ? (char *)mFree[c] - mBase : -1);
+		for (auto &large : mLarge)
+			state.large.push_back({(char *)large.first - mBase, large.second});
+		for (int32_t c = 0; c < 64; c++)
+			for (Block *block : mLargeFree[c])
+				state.largeFree.push_back({(char *)block - mBase, c});
+		for (const Site &s : mSites){
+			state.sites.push_back(s.allocs);
+			state.sites.push_back(s.bytes);
+			state.sites.push_back(s.liveBlocks);
+			state.sites.push_back(s.liveBytes);
+		}
+		state.allocs = mAllocs;
+		state.frees = mFrees;
+		state.liveBlocks = mLiveBlocks;
+		state.liveBytes = mLiveBytes;
+		state.peakBytes = mPeakBytes;
+		return state;
+	}
+
+	/// Takes over state once the heap's memory holds the blocks it names;
+	/// false if they aren't where it says, or the sites don't match
+	bool restore(const State &state){
+		if (state.bytesUsed > (uint64_t)(mLimit - mBase) || state.free.size() != NumClasses + 1 || state.sites.size() != 4 * mSites.size())
+			return false;
+		mBump = mBase + state.bytesUsed;
+		for (size_t c = 0; c <= NumClasses; c++){
+			mFree[c] = state.free[c] < 0 ? NULL : block(state.free[c]);
+			if (state.free[c] >= 0 && (!mFree[c] || mFree[c]->magic != FreeMagic))
+				return false;
+		}
+		for (auto &large : state.large){
+			Block *b = block(large.first);
+			if (!b || large.second < 0 || large.second >= 64)
+				return false;
+			mLarge[b] = large.second;
+		}
+		for (auto &large : state.largeFree){
+			Block *b = block(large.first);
+			if (!b || large.second < 0 || large.second >= 64)
+				return false;
+			mLargeFree[large.second].push_back(b);
+		}
+		for (size_t i = 0; i < mSites.size(); i++){
+			mSites[i].allocs = state.sites[4 * i];
+			mSites[i].bytes = state.sites[4 * i + 1];
+			mSites[i].liveBlocks = state.sites[4 * i + 2];
+			mSites[i].liveBytes = state.sites[4 * i + 3];
+		}
+		mAllocs = state.allocs;
+		mFrees = state.frees;
+		mLiveBlocks = state.liveBlocks;
+		mLiveBytes = state.liveBytes;
+		mPeakBytes = state.peakBytes;
+		return true;
+	}
+	int64_t peakBytes() const{
+		return mPeakBytes;
+	}
+
+	void printStats(llvm::raw_ostream &os) const{
+		os << "guest heap: " << mAllocs << " allocations, " << mFrees << " frees, peak " << mPeakBytes
+		   << " bytes, live at exit " << mLiveBytes << " bytes in " << mLiveBlocks << " blocks\n";
+		for (const Site &s : mSites){
+			if (!s.allocs)
+				continue;
+			os << "  " << s.name << ": " << s.allocs << " allocations, " << s.bytes << " bytes";
+			if (s.liveBlocks)
+				os << ", leaked " << s.liveBytes << " bytes in " << s.liveBlocks << " blocks";
+			os << "\n";
+		}
+	}
+
+private:
+	/// Class c holds payloads of up to c * Granule bytes
+	static size_t sizeClass(int64_t size){
+		size_t cls = (size + Granule - 1) / Granule;
+		return cls ? cls : 1;
+	}
+
+	/// Blocks of more than NumClasses granules take the power of two
+	/// that fits them and their header
+	static int32_t largeClass(int64_t size){
+		int32_t cls = 0;
+		while (((size_t)1 << cls) < sizeof(Block) + (size_t)size)
+			cls++;
+		return cls;
+	}
+
+	/// Whether block's header lies in the part of the heap handed out so far
+	bool inHeap(const Block *block) const{
+		return (const char *)block >= mBase && (const char *)(block + 1) <= mBump;
+	}
+
+	/// The block at offset, if one can be there
+	Block *block(int64_t offset) const{
+		if (offset < 0 || offset % Granule != 0 || (uint64_t)offset >= (uint64_t)(mBump - mBase))
+			return NULL;
+		Block *b = (Block *)(mBase + offset);
+		return inHeap(b) ? b : NULL;
+	}
+
+	void *carve(size_t bytes){
+		if ((size_t)(mLimit - mBump) < bytes){
+			guestError("guest heap exhausted");
+		}
+		void *block = mBump;
+		mBump += bytes;
+		return block;
+	}
+
+	[[noreturn]] static void invalidFree(void *ptr){
+		guestError("invalid free of " + describe(ptr));
+	}
+	static std::string describe(void *ptr){
+		return "0x" + llvm::utohexstr((uintptr_t)ptr, true);
+	}
+};
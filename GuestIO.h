@@ -0,0 +1,247 @@
+#pragma once
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <string>
+
+/// Buffered sink for everything a guest program writes. Nothing reaches the
+/// file descriptor (or the string, for runs that are collected) until the
+/// buffer fills, flush() is called, or the channel is destroyed. In binary
+/// mode PRINT writes each value as 8 native-endian bytes instead of a line.
+class GuestOutput{
+	static const size_t BufferBytes = 64 << 10;
+
+	int mFd;
+	std::string *mString;
+	bool mBinary;
+	size_t mUsed;
+	char mBuffer[BufferBytes];
+
+public:
+	explicit GuestOutput(int fd, bool binary = false) : mFd(fd), mString(NULL), mBinary(binary), mUsed(0){
+	}
+	explicit GuestOutput(std::string &str, bool binary = false) : mFd(-1), mString(&str), mBinary(binary), mUsed(0){
+	}
+	~GuestOutput(){
+		flush();
+	}
+	GuestOutput(const GuestOutput &) = delete;
+	GuestOutput &operator=(const GuestOutput &) = delete;
+
+	bool binary() const{
+		return mBinary;
+	}
+
+	void print(int64_t val){
+		if (mBinary){
+			write((const char *)&val, sizeof(val));
+			return;
+		}
+		char digits[24];
+		char *end = digits + sizeof(digits);
+		char *p = end;
+		*--p = '\n';
+		uint64_t mag = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+		do {
+			*--p = '0' + mag % 10;
+			mag /= 10;
+		} while (mag);
+		if (val < 0)
+			*--p = '-';
+		write(p, end - p);
+	}
+
+	void text(const std::string &str){
+		write(str.data(), str.size());
+	}
+
+	void write(const char *data, size_t bytes){
+		if (bytes > BufferBytes - mUsed){
+			flush();
+			if (bytes > BufferBytes){
+				emit(data, bytes);
+				return;
+			}
+		}
+		memcpy(mBuffer + mUsed, data, bytes);
+		mUsed += bytes;
+	}
+
+	void flush(){
+		emit(mBuffer, mUsed);
+		mUsed = 0;
+	}
+
+private:
+	void emit(const char *data, size_t bytes){
+		if (mString){
+			mString->append(data, bytes);
+			return;
+		}
+		while (bytes){
+			ssize_t n = ::write(mFd, data, bytes);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return;
+			data += n;
+			bytes -= n;
+		}
+	}
+};
+
+/// Source of the integers GET returns. Regular files are mapped whole and
+/// parsed in place; pipes and terminals are read a chunk at a time, after
+/// flushing the output so a prompt is visible before the read blocks.
+/// Like cin >> once it fails, a malformed or exhausted input yields 0
+/// from then on.
+class GuestInput{
+	static const size_t ChunkBytes = 64 << 10;
+
+	int mFd;
+	void *mMap;
+	size_t mMapBytes;
+	const char *mPos;
+	const char *mEnd;
+	std::string mChunk;
+	bool mEof;
+	bool mFailed;
+	GuestOutput *mFlush;
+
+public:
+	/// Reads fd from its current offset
+	explicit GuestInput(int fd) : mFd(fd), mMap(NULL), mMapBytes(0), mPos(NULL), mEnd(NULL), mEof(false), mFailed(false), mFlush(NULL){
+		struct stat st;
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset){
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED){
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				mMap = map;
+				mMapBytes = st.st_size;
+				mPos = (const char *)map + offset;
+				mEnd = (const char *)map + st.st_size;
+				mEof = true;
+			}
+		}
+	}
+	/// Parses a copy of str
+	explicit GuestInput(const std::string &str) : mFd(-1), mMap(NULL), mMapBytes(0), mChunk(str), mEof(true), mFailed(false), mFlush(NULL){
+		mPos = mChunk.data();
+		mEnd = mPos + mChunk.size();
+	}
+	~GuestInput(){
+		if (mMap)
+			munmap(mMap, mMapBytes);
+	}
+	GuestInput(const GuestInput &) = delete;
+	GuestInput &operator=(const GuestInput &) = delete;
+
+	/// Output to flush before blocking on more input
+	void setFlush(GuestOutput *out){
+		mFlush = out;
+	}
+
+	int64_t readInt(){
+		if (mFailed)
+			return 0;
+		int c;
+		while ((c = peek()) != EOF && isspace(c))
+			mPos++;
+		bool negative = false;
+		if (c == '-' || c == '+'){
+			negative = c == '-';
+			mPos++;
+			c = peek();
+		}
+		if (c == EOF || !isdigit(c)){
+			mFailed = true;
+			return 0;
+		}
+		uint64_t mag = 0;
+		while ((c = peek()) != EOF && isdigit(c)){
+			mag = mag * 10 + (c - '0');
+			mPos++;
+		}
+		return negative ? (int64_t)(0 - mag) : (int64_t)mag;
+	}
+
+private:
+	int peek(){
+		if (mPos == mEnd && !refill())
+			return EOF;
+		return (unsigned char)*mPos;
+	}
+
+	bool refill(){
+		if (mEof)
+			return false;
+		if (mFlush)
+			mFlush->flush();
+		mChunk.resize(ChunkBytes);
+		ssize_t n;
+		do
+			n = ::read(mFd, &mChunk[0], ChunkBytes);
+		while (n < 0 && errno == EINTR);
+		if (n <= 0){
+			mEof = true;
+			mChunk.clear();
+			mPos = mEnd = mChunk.data();
+			return false;
+		}
+		mPos = mChunk.data();
+		mEnd = mPos + n;
+		return true;
+	}
+};
+
+/// The channels of one guest run, and how GET and PRINT use them. Once the
+/// run has started a guest thread, each call takes a lock.
+class GuestIO{
+	GuestInput &mIn;
+	GuestOutput &mOut;
+	bool mPrompt;
+	bool mShared;
+	std::mutex mLock;
+
+public:
+	GuestIO(GuestInput &in, GuestOutput &out, bool prompt) : mIn(in), mOut(out), mPrompt(prompt && !out.binary()), mShared(false){
+		mIn.setFlush(&mOut);
+	}
+
+	/// Called before a second guest thread starts
+	void share(){
+		mShared = true;
+	}
+
+	int64_t get(){
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (mShared)
+			guard.lock();
+		if (mPrompt)
+			mOut.text("Please Input an Integer Value : \n");
+		return mIn.readInt();
+	}
+	void print(int64_t val){
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (mShared)
+			guard.lock();
+		mOut.print(val);
+	}
+	void error(const std::string &message){
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (mShared)
+			guard.lock();
+		mOut.text("error! " + message + "\n");
+	}
+	GuestOutput &output(){
+		return mOut;
+	}
+};
@@ -0,0 +1,178 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string>
+#include "GuestExit.h"
+#include "TypedAccess.h"
+#include "llvm/ADT/StringExtras.h"
+
+/// Every byte a guest program can address: its call stack (frames, local
+/// and global arrays), its heap, then, for a program that can SPAWN, a
+/// stack for each guest thread, in one region reserved with mmap. Guard pages on both sides
+/// stay inaccessible. Guest pointers are host addresses, and every load and
+/// store the guest makes through one is first checked to fall inside the
+/// region, which is a single unsigned compare of its offset from the base.
+/// A stray pointer then ends the
+/// program with a guest error instead of reaching interpreter memory.
+/// What the engines keep about frames and heap blocks for themselves is
+/// either held outside the region or validated before use.
+class GuestMemory{
+	static const size_t GuardBytes = 64 << 10;
+
+	char *mRegion;
+	size_t mRegionBytes;
+	/// The accessible part: [mBase, mBase + mBytes)
+	char *mBase;
+	uint64_t mBytes;
+	size_t mStackBytes;
+	size_t mHeapBytes;
+	size_t mThreadStackBytes;
+	int32_t mThreads;
+
+public:
+	static const size_t HeapReserve = (size_t)1 << 30;
+	/// Guest threads that can run at once besides main
+	static const int32_t MaxThreads = 64;
+	/// Each thread's stack is as big as main's, up to this
+	static const size_t ThreadStackReserve = (size_t)32 << 20;
+
+	/// threads is how many thread stacks to reserve: MaxThreads for a
+	/// program that can SPAWN, else none. at, if given, is where the
+	/// accessible part has to start: a restored Snapshot's pointers are
+	/// only valid there.
+	explicit GuestMemory(size_t stackBytes, size_t heapBytes = HeapReserve, char *at = NULL, int32_t threads = 0){
+		size_t page = sysconf(_SC_PAGESIZE);
+		mStackBytes = (stackBytes + page - 1) & ~(page - 1);
+		mHeapBytes = (heapBytes + page - 1) & ~(page - 1);
+		mThreadStackBytes = std::min(mStackBytes, ThreadStackReserve);
+		mThreads = threads;
+		mBytes = mStackBytes + mHeapBytes + threads * mThreadStackBytes;
+		mRegionBytes = mBytes + 2 * GuardBytes;
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_FIXED_NOREPLACE
+		if (at)
+			flags |= MAP_FIXED_NOREPLACE;
+#endif
+		void *region = mmap(at ? at - GuardBytes : NULL, mRegionBytes, PROT_NONE, flags, -1, 0);
+		if (at && region != at - GuardBytes){
+			if (region != MAP_FAILED)
+				munmap(region, mRegionBytes);
+			guestError("can't map guest memory at 0x" + llvm::utohexstr((uintptr_t)at, true) + ", which is in use");
+		}
+		if (region != MAP_FAILED && mprotect((char *)region + GuardBytes, mBytes, PROT_READ | PROT_WRITE) != 0){
+			munmap(region, mRegionBytes);
+			region = MAP_FAILED;
+		}
+		if (region == MAP_FAILED)
+			guestError("can't reserve " + std::to_string(mRegionBytes >> 20) + "m of guest memory");
+		mRegion = (char *)region;
+		mBase = mRegion + GuardBytes;
+	}
+	~GuestMemory(){
+		munmap(mRegion, mRegionBytes);
+	}
+	GuestMemory(const GuestMemory &) = delete;
+	GuestMemory &operator=(const GuestMemory &) = delete;
+
+	/// Thread 0 is main; threads 1 to threads() have stacks after the heap
+	char *stackBase(int32_t thread = 0) const{
+		return thread ? mBase + mStackBytes + mHeapBytes + (thread - 1) * mThreadStackBytes : mBase;
+	}
+	size_t stackBytes(int32_t thread = 0) const{
+		return thread ? mThreadStackBytes : mStackBytes;
+	}
+	int32_t threads() const{
+		return mThreads;
+	}
+	char *heapBase() const{
+		return mBase + mStackBytes;
+	}
+	size_t heapBytes() const{
+		return mHeapBytes;
+	}
+	/// For code that inlines contains()
+	const char *base() const{
+		return mBase;
+	}
+	uint64_t bytes() const{
+		return mBytes;
+	}
+
+	bool contains(int64_t addr, int64_t bytes) const{
+		return (uint64_t)addr - (uint64_t)mBase <= mBytes - (uint64_t)bytes;
+	}
+	void check(int64_t addr, int64_t bytes) const{
+		if (!contains(addr, bytes))
+			fault(addr);
+	}
+	void checkAtomic(int64_t addr, int64_t bytes) const{
+		check(addr, bytes);
+		if (addr % bytes)
+			guestError("misaligned atomic access at 0x" + llvm::utohexstr((uint64_t)addr, true));
+	}
+	/// Elements first up to end of the array of width-byte elements at base
+	void checkRange(int64_t base, int64_t width, int64_t first, int64_t end) const{
+		if (first < end){
+			if ((uint64_t)(end - first) > mBytes / width)
+				fault(base + (int64_t)((uint64_t)first * width));
+			check(base + (int64_t)((uint64_t)first * width), width);
+			check(base + (int64_t)((uint64_t)(end - 1) * width), width);
+		}
+	}
+
+	template <typename T>
+	int64_t load(int64_t base, int64_t index) const{
+		int64_t addr = base + (int64_t)((uint64_t)index * sizeof(T));
+		check(addr, sizeof(T));
+		return *(const T *)addr;
+	}
+	template <typename T>
+	void store(int64_t base, int64_t index, int64_t val) const{
+		int64_t addr = base + (int64_t)((uint64_t)index * sizeof(T));
+		check(addr, sizeof(T));
+		*(T *)addr = (T)val;
+	}
+
+	int64_t load(ElemKind kind, int64_t base, int64_t index) const{
+		switch (kind){
+		case EK_I8: return load<int8_t>(base, index);
+		case EK_U8: return load<uint8_t>(base, index);
+		case EK_I16: return load<int16_t>(base, index);
+		case EK_U16: return load<uint16_t>(base, index);
+		case EK_I32: return load<int32_t>(base, index);
+		case EK_U32: return load<uint32_t>(base, index);
+		default: return load<int64_t>(base, index);
+		}
+	}
+	void store(ElemKind kind, int64_t base, int64_t index, int64_t val) const{
+		switch (elemBytes(kind)){
+		case 1: store<int8_t>(base, index, val); break;
+		case 2: store<int16_t>(base, index, val); break;
+		case 4: store<int32_t>(base, index, val); break;
+		default: store<int64_t>(base, index, val); break;
+		}
+	}
+
+	/// ATOMIC_ADD and ATOMIC_CAS: sequentially consistent, returning the
+	/// old value. Guest threads share this memory, and the hardware only
+	/// makes aligned accesses atomic.
+	template <typename T>
+	int64_t fetchAdd(int64_t addr, int64_t val) const{
+		checkAtomic(addr, sizeof(T));
+		return __atomic_fetch_add((T *)addr, (T)val, __ATOMIC_SEQ_CST);
+	}
+	template <typename T>
+	int64_t compareExchange(int64_t addr, int64_t expected, int64_t desired) const{
+		checkAtomic(addr, sizeof(T));
+		T old = (T)expected;
+		__atomic_compare_exchange_n((T *)addr, &old, (T)desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		return old;
+	}
+
+	[[noreturn]] static void fault(int64_t addr){
+		guestError("invalid memory access at 0x" + llvm::utohexstr((uint64_t)addr, true));
+	}
+};
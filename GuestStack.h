@@ -0,0 +1,121 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <string>
+#include "GuestExit.h"
+#include "GuestMemory.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Contiguous guest call stack of one guest thread in GuestMemory. The kernel
+/// commits pages as frames first touch them, so it grows on demand without
+/// ever moving live frames. Frames are contiguous slices; pushing and
+/// popping one is a pointer bump.
+class GuestStack{
+	char *mBase;
+	char *mTop;
+	char *mLimit;
+	size_t mDepth;
+	size_t mPeakDepth;
+	size_t mPeakBytes;
+
+public:
+	static const size_t DefaultReserve = (size_t)256 << 20;
+
+	explicit GuestStack(GuestMemory &memory, int32_t thread = 0) : mDepth(0), mPeakDepth(0), mPeakBytes(0){
+		mBase = mTop = memory.stackBase(thread);
+		mLimit = mBase + memory.stackBytes(thread);
+	}
+	GuestStack(const GuestStack &) = delete;
+	GuestStack &operator=(const GuestStack &) = delete;
+
+	/// Returns bytes of uninitialized, 8-byte aligned frame storage
+	void *pushFrame(size_t bytes){
+		bytes = (bytes + 7) & ~(size_t)7;
+		if (bytes > (size_t)(mLimit - mTop)){
+			overflow();
+		}
+		void *frame = mTop;
+		mTop += bytes;
+		if (++mDepth > mPeakDepth)
+			mPeakDepth = mDepth;
+		if ((size_t)(mTop - mBase) > mPeakBytes)
+			mPeakBytes = mTop - mBase;
+		return frame;
+	}
+
+	/// Releases frame and every frame pushed after it
+	void popFrame(void *frame){
+		mTop = (char *)frame;
+		mDepth--;
+	}
+
+	size_t depth() const{
+		return mDepth;
+	}
+	size_t peakDepth() const{
+		return mPeakDepth;
+	}
+	size_t bytesUsed() const{
+		return mTop - mBase;
+	}
+	size_t peakBytes() const{
+		return mPeakBytes;
+	}
+	size_t reserved() const{
+		return mLimit - mBase;
+	}
+
+	/// What a Snapshot keeps besides the frames themselves
+	struct State{
+		uint64_t bytesUsed;
+		uint64_t depth;
+		uint64_t peakDepth;
+		uint64_t peakBytes;
+	};
+	State state() const{
+		return State{bytesUsed(), mDepth, mPeakDepth, mPeakBytes};
+	}
+	/// False if state doesn't fit this stack
+	bool restore(const State &state){
+		if (state.bytesUsed > reserved() || state.bytesUsed % 8 || state.peakBytes > reserved())
+			return false;
+		mTop = mBase + state.bytesUsed;
+		mDepth = state.depth;
+		mPeakDepth = state.peakDepth;
+		mPeakBytes = state.peakBytes;
+		return true;
+	}
+
+	/// Zero-fills frame memory. Large blocks hand their whole pages back to
+	/// the kernel instead, which maps fresh zero pages on first touch.
+	static void zero(void *mem, size_t bytes){
+		static const size_t LazyZeroBytes = 256 << 10;
+		if (bytes < LazyZeroBytes){
+			memset(mem, 0, bytes);
+			return;
+		}
+		uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t begin = (uintptr_t)mem;
+		uintptr_t end = begin + bytes;
+		uintptr_t first = (begin + page - 1) & ~(page - 1);
+		uintptr_t last = end & ~(page - 1);
+		memset(mem, 0, first - begin);
+		if (madvise((void *)first, last - first, MADV_DONTNEED) != 0)
+			memset((void *)first, 0, last - first);
+		memset((void *)last, 0, end - last);
+	}
+
+	/// Ends the program: the guest recursed past the stack budget
+	[[noreturn]] void overflow() const{
+		guestError("guest stack overflow at depth " + std::to_string(mDepth) + " (limit " + std::to_string(reserved()) + " bytes)");
+	}
+
+	void printStats(llvm::raw_ostream &os) const{
+		os << "guest stack: peak depth " << mPeakDepth << " frames, peak " << mPeakBytes
+		   << " bytes, in use " << bytesUsed() << " bytes, reserved " << reserved() << " bytes\n";
+	}
+};
@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "GuestExit.h"
+#include "GuestMemory.h"
+#include "HostStack.h"
+
+/// The guest threads SPAWN starts. Each runs on a host thread of its own,
+/// with the GuestMemory stack of the slot it was given; JOIN waits for one
+/// and hands back what its function returned, or ends the joining thread
+/// with the guest error that ended it. A program isn't over until all its
+/// threads are: whoever ran main joins the rest with joinAll().
+class GuestThreads{
+	struct Thread{
+		HostStack host;
+		int32_t slot;
+		int64_t result;
+		Thread(size_t hostBytes, int32_t slot) : host(hostBytes), slot(slot), result(0){
+		}
+	};
+
+	/// Host stack each thread gets beyond HostStack's margin
+	size_t mHostBytes;
+	std::mutex mLock;
+	/// By handle - 1; NULL once joined
+	std::vector<std::unique_ptr<Thread>> mThreads;
+	std::vector<int32_t> mFreeSlots;
+	int64_t mRunning;
+
+public:
+	/// A slot for each thread stack memory has
+	GuestThreads(const GuestMemory &memory, size_t hostBytes) : mHostBytes(hostBytes), mRunning(0){
+		for (int32_t slot = memory.threads(); slot > 0; slot--)
+			mFreeSlots.push_back(slot);
+	}
+	/// After a guest error nobody may have joined them
+	~GuestThreads(){
+		for (;;){
+			try{
+				joinAll();
+				return;
+			} catch (...){
+			}
+		}
+	}
+
+	/// Whether some thread hasn't been joined yet
+	bool running(){
+		std::lock_guard<std::mutex> guard(mLock);
+		return mRunning > 0;
+	}
+
+	/// A free stack slot for the next thread; start() hands it back
+	int32_t claim(){
+		std::lock_guard<std::mutex> guard(mLock);
+		if (mFreeSlots.empty())
+			guestError("too many guest threads (at most " + std::to_string(GuestMemory::MaxThreads) + " at once; JOIN frees one)");
+		int32_t slot = mFreeSlots.back();
+		mFreeSlots.pop_back();
+		return slot;
+	}
+
+	/// Runs body(hostLimit) on a new thread with slot's stack; the handle JOIN takes
+	int64_t start(int32_t slot, std::function<int64_t(const char *)> body){
+		Thread *thread = new Thread(mHostBytes, slot);
+		int64_t handle;
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			mThreads.emplace_back(thread);
+			handle = mThreads.size();
+			mRunning++;
+		}
+		if (!thread->host.start([thread, body](){ thread->result = body(thread->host.limit()); })){
+			std::lock_guard<std::mutex> guard(mLock);
+			mThreads[handle - 1].reset();
+			mFreeSlots.push_back(slot);
+			mRunning--;
+			guestError("can't start a guest thread");
+		}
+		return handle;
+	}
+
+	int64_t join(int64_t handle){
+		std::unique_ptr<Thread> thread;
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			if (handle < 1 || handle > (int64_t)mThreads.size() || !mThreads[handle - 1])
+				guestError("bad thread handle " + std::to_string(handle));
+			thread = std::move(mThreads[handle - 1]);
+		}
+		thread->host.join();
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			mFreeSlots.push_back(thread->slot);
+			mRunning--;
+		}
+		if (thread->host.error())
+			std::rethrow_exception(thread->host.error());
+		return thread->result;
+	}
+
+	/// Waits for the threads nobody joined; the first of them to have
+	/// failed fails the program
+	void joinAll(){
+		for (size_t handle = 1;; handle++){
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				if (handle > mThreads.size())
+					return;
+				if (!mThreads[handle - 1])
+					continue;
+			}
+			join(handle);
+		}
+	}
+};
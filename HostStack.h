@@ -0,0 +1,87 @@
+#pragma once
+#include <pthread.h>
+#include <exception>
+#include <functional>
+
+/// Runs the AST engine on a host stack of a chosen size. Every guest call
+/// the AST engine makes nests host frames, so the thread it runs on gets a
+/// stack as large as the guest stack budget, and Environment checks the
+/// room left against limit() before each call. Running out then ends the
+/// program with a guest error instead of a crash. (The VM needs none of
+/// this, since its guest calls only push frames on the GuestStack, except
+/// when it calls native code compiled by the Jit.) Guest threads each run
+/// on a HostStack of their own, started and joined separately.
+class HostStack{
+	/// Kept free below limit() for the host code between two guest calls
+	static const size_t Margin = 256 << 10;
+
+	size_t mBytes;
+	const char *mLimit;
+	std::function<void()> mFn;
+	std::exception_ptr mError;
+	pthread_t mThread;
+	bool mStarted;
+
+public:
+	explicit HostStack(size_t bytes) : mBytes(bytes + Margin), mLimit(NULL), mStarted(false){
+	}
+	~HostStack(){
+		join();
+	}
+	HostStack(const HostStack &) = delete;
+	HostStack &operator=(const HostStack &) = delete;
+
+	/// Lowest address guest calls may reach; NULL when fn runs on the
+	/// caller's stack because no thread could be started
+	const char *limit() const{
+		return mLimit;
+	}
+
+	/// Runs fn to completion on a thread with this stack. Whatever fn
+	/// throws is rethrown here.
+	void run(std::function<void()> fn){
+		if (!start(std::move(fn))){
+			mLimit = NULL;
+			mFn();
+			return;
+		}
+		join();
+		if (mError)
+			std::rethrow_exception(mError);
+	}
+
+	/// Starts fn on a thread with this stack and returns at once; false
+	/// if no thread could be started
+	bool start(std::function<void()> fn){
+		mFn = std::move(fn);
+		pthread_attr_t attr;
+		if (pthread_attr_init(&attr) != 0)
+			return false;
+		mStarted = pthread_attr_setstacksize(&attr, mBytes) == 0 && pthread_create(&mThread, &attr, &entry, this) == 0;
+		pthread_attr_destroy(&attr);
+		return mStarted;
+	}
+
+	/// Waits for the thread start() began; what fn threw is then error()
+	void join(){
+		if (mStarted){
+			pthread_join(mThread, NULL);
+			mStarted = false;
+		}
+	}
+	std::exception_ptr error() const{
+		return mError;
+	}
+
+private:
+	static void *entry(void *arg){
+		HostStack *stack = (HostStack *)arg;
+		stack->mLimit = (const char *)__builtin_frame_address(0) - (stack->mBytes - Margin);
+		try{
+			stack->mFn();
+		} catch (...){
+			stack->mError = std::current_exception();
+		}
+		return NULL;
+	}
+};
@@ -0,0 +1,451 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Bytecode.h"
+#include "GuestMemory.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Tier-up compiler for the VM (--jit). A function the VM has called
+/// threshold times is translated from its bytecode to LLVM IR, optimized
+/// and compiled to native code with ORC, and later calls run that instead.
+/// Native code keeps the VM's memory layout: registers become SSA values,
+/// local arrays live on the GuestStack, every load and store is checked
+/// against GuestMemory, and GET, PRINT, MALLOC, FREE and
+/// calls to functions still being interpreted go through the Hooks.
+/// Everything a compiled function refers to (globals, hooks, the table of
+/// native entry points) is embedded as an address, so a Jit serves the
+/// one VM that created it.
+class Jit{
+public:
+	/// Every compiled function takes its arguments as an array
+	typedef int64_t (*NativeFn)(const int64_t *args);
+
+	/// Host implementations native code calls back into; env is the VM
+	struct Hooks{
+		void *env;
+		int64_t (*get)(void *env);
+		void (*print)(void *env, int64_t val);
+		int64_t (*malloc)(void *env, int64_t bytes, int64_t site);
+		void (*free)(void *env, int64_t ptr);
+		/// Runs vector loop number loop over a copy of the registers
+		void (*vecLoop)(void *env, int64_t loop, int64_t *regs, int64_t bound);
+		/// Runs function fn in the interpreter
+		int64_t (*call)(void *env, int64_t fn, const int64_t *args);
+		/// Returns arrayBytes of frame storage for local arrays
+		char *(*pushArrays)(void *env, int64_t bytes);
+		void (*popArrays)(void *env, char *arrays);
+		void (*zero)(char *mem, int64_t bytes);
+		/// Raise guest errors; they never return
+		void (*divZero)(void *env);
+		void (*overflow)(void *env);
+		void (*fault)(int64_t addr);
+	};
+
+private:
+	/// Memsets shorter than this are inlined; GuestStack::zero handles the rest
+	static const int64_t InlineZeroBytes = 256 << 10;
+	/// Counts at this value mean the function failed to compile and stays interpreted
+	static const int64_t NeverCompile = INT64_MIN;
+
+	const BCProgram &mProg;
+	const int64_t *mGlobals;
+	const GuestMemory &mMemory;
+	Hooks mHooks;
+	int64_t mThreshold;
+	const char *mHostLimit;
+	std::unique_ptr<llvm::orc::LLJIT> mLLJIT;
+	/// Per function: its native entry point, or NULL while interpreted
+	std::vector<NativeFn> mNatives;
+	std::vector<int64_t> mCalls;
+	int64_t mCompiled;
+	int64_t mInterpreted;
+	int64_t mNativeCalls;
+	double mCompileMs;
+	std::string mError;
+
+public:
+	/// hostLimit is the lowest address native recursion may reach, or NULL
+	/// when the host stack isn't checked
+	Jit(const BCProgram &prog, const int64_t *globals, const GuestMemory &memory, const Hooks &hooks, int64_t threshold,
+	    const char *hostLimit)
+	    : mProg(prog), mGlobals(globals), mMemory(memory), mHooks(hooks), mThreshold(threshold < 1 ? 1 : threshold), mHostLimit(hostLimit),
+	      mNatives(prog.functions.size(), nullptr), mCalls(prog.functions.size(), 0), mCompiled(0), mInterpreted(0),
+	      mNativeCalls(0), mCompileMs(0){
+		keepSnapshotsInterpreted();
+	}
+
+	/// Native code for fn if it has some, compiling it on the call that
+	/// makes it hot; NULL means interpret this call
+	NativeFn enter(int32_t fn){
+		if (NativeFn native = mNatives[fn]){
+			mNativeCalls++;
+			return native;
+		}
+		mInterpreted++;
+		if (++mCalls[fn] < mThreshold)
+			return NULL;
+		return compile(fn);
+	}
+
+	void printStats(llvm::raw_ostream &os) const{
+		os << "jit: " << mCompiled << " of " << mProg.functions.size() << " functions compiled in "
+		   << llvm::format("%.3f", mCompileMs) << " ms (threshold " << mThreshold << "), "
+		   << mInterpreted << " interpreted calls, " << mNativeCalls << " calls into native code\n";
+		if (!mError.empty())
+			os << "jit: " << mError << "\n";
+	}
+
+private:
+	/// A snapshot can't hold native frames, so functions that may reach
+	/// SNAPSHOT() stay interpreted along with their callers
+	void keepSnapshotsInterpreted(){
+		bool changed = true;
+		while (changed){
+			changed = false;
+			for (size_t f = 0; f < mProg.functions.size(); f++){
+				if (mCalls[f] == NeverCompile)
+					continue;
+				for (const Insn &I : mProg.functions[f].code)
+					if (I.op == OP_SNAPSHOT || (I.op == OP_CALL && mCalls[I.b] == NeverCompile)){
+						mCalls[f] = NeverCompile;
+						changed = true;
+						break;
+					}
+			}
+		}
+	}
+
+	NativeFn compile(int32_t fn){
+		auto started = std::chrono::steady_clock::now();
+		NativeFn native = build(fn);
+		mCompileMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+		if (!native){
+			mCalls[fn] = NeverCompile;
+			return NULL;
+		}
+		mCompiled++;
+		mNatives[fn] = native;
+		return native;
+	}
+
+	bool fail(llvm::Error err){
+		mError = llvm::toString(std::move(err));
+		return false;
+	}
+
+	bool start(){
+		if (mLLJIT)
+			return true;
+		static std::once_flag targets;
+		std::call_once(targets, [](){
+			llvm::InitializeNativeTarget();
+			llvm::InitializeNativeTargetAsmPrinter();
+		});
+		auto jit = llvm::orc::LLJITBuilder().create();
+		if (!jit)
+			return fail(jit.takeError());
+		mLLJIT = std::move(*jit);
+		mLLJIT->getExecutionSession().setErrorReporter([this](llvm::Error err){
+			fail(std::move(err));
+		});
+		// memset and friends the optimizer introduces come from the host
+		auto host = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(mLLJIT->getDataLayout().getGlobalPrefix());
+		if (!host)
+			return fail(host.takeError());
+		mLLJIT->getMainJITDylib().addGenerator(std::move(*host));
+		return true;
+	}
+
+	NativeFn build(int32_t fn){
+		if (!start())
+			return NULL;
+		auto context = std::make_unique<llvm::LLVMContext>();
+		auto module = std::make_unique<llvm::Module>(mProg.functions[fn].name, *context);
+		module->setDataLayout(mLLJIT->getDataLayout());
+		module->setTargetTriple(mLLJIT->getTargetTriple().str());
+		std::string name = "guest." + std::to_string(fn) + "." + mProg.functions[fn].name;
+		if (!emit(*module, mProg.functions[fn], name)){
+			mError = "can't translate " + mProg.functions[fn].name;
+			return NULL;
+		}
+		optimize(*module);
+		if (llvm::Error err = mLLJIT->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))){
+			fail(std::move(err));
+			return NULL;
+		}
+		auto symbol = mLLJIT->lookup(name);
+		if (!symbol){
+			fail(symbol.takeError());
+			return NULL;
+		}
+		return (NativeFn)symbol->getAddress();
+	}
+
+	static void optimize(llvm::Module &module){
+		llvm::LoopAnalysisManager loops;
+		llvm::FunctionAnalysisManager functions;
+		llvm::CGSCCAnalysisManager sccs;
+		llvm::ModuleAnalysisManager modules;
+		llvm::PassBuilder builder;
+		builder.registerModuleAnalyses(modules);
+		builder.registerCGSCCAnalyses(sccs);
+		builder.registerFunctionAnalyses(functions);
+		builder.registerLoopAnalyses(loops);
+		builder.crossRegisterProxies(loops, functions, sccs, modules);
+		builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2).run(module, modules);
+	}
+
+	/// Translates one function; every instruction that starts a basic block
+	/// (jump targets and whatever follows a jump or return) gets one
+	bool emit(llvm::Module &module, const BCFunction &fn, const std::string &name){
+		llvm::LLVMContext &ctx = module.getContext();
+		llvm::IRBuilder<> b(ctx);
+		llvm::Type *i64 = b.getInt64Ty();
+		llvm::Type *i8p = b.getInt8PtrTy();
+		llvm::Type *i64p = i64->getPointerTo();
+		llvm::FunctionType *nativeTy = llvm::FunctionType::get(i64, {i64p}, false);
+		llvm::Function *f = llvm::Function::Create(nativeTy, llvm::Function::ExternalLinkage, name, module);
+		// Guest errors are C++ exceptions thrown by the hooks, unwinding through native frames
+		f->addFnAttr(llvm::Attribute::UWTable);
+
+		llvm::BasicBlock *entry = llvm::BasicBlock::Create(ctx, "entry", f);
+		b.SetInsertPoint(entry);
+		std::vector<llvm::Value *> regs(fn.numRegs);
+		for (int32_t r = 0; r < fn.numRegs; r++)
+			regs[r] = b.CreateAlloca(i64, nullptr, "r" + std::to_string(r));
+		int32_t maxArgs = 1;
+		bool vecLoops = false;
+		for (const Insn &I : fn.code){
+			if (I.op == OP_CALL && mProg.functions[I.b].numParams > maxArgs)
+				maxArgs = mProg.functions[I.b].numParams;
+			vecLoops |= I.op == OP_VLOOP;
+		}
+		llvm::Value *argv = b.CreateAlloca(i64, b.getInt32(maxArgs), "args");
+		/// Where vector loops find the registers
+		llvm::Value *spill = vecLoops ? b.CreateAlloca(i64, b.getInt32(fn.numRegs), "spill") : nullptr;
+		for (int32_t p = 0; p < fn.numParams; p++)
+			b.CreateStore(b.CreateLoad(i64, b.CreateConstGEP1_32(i64, f->getArg(0), p)), regs[p]);
+
+		auto hook = [&](void *addr, llvm::Type *ret, llvm::ArrayRef<llvm::Type *> params, llvm::ArrayRef<llvm::Value *> args){
+			llvm::FunctionType *type = llvm::FunctionType::get(ret, params, false);
+			llvm::Value *callee = b.CreateIntToPtr(b.getInt64((uint64_t)addr), type->getPointerTo());
+			return b.CreateCall(type, callee, args);
+		};
+		llvm::Value *env = b.CreateIntToPtr(b.getInt64((uint64_t)mHooks.env), i8p);
+		// Native calls nest host frames, so recursion is checked against the host stack
+		if (mHostLimit){
+			llvm::Function *frameAddress = llvm::Intrinsic::getDeclaration(&module, llvm::Intrinsic::frameaddress, {i8p});
+			llvm::Value *sp = b.CreatePtrToInt(b.CreateCall(frameAddress, {b.getInt32(0)}), i64);
+			llvm::BasicBlock *overflow = llvm::BasicBlock::Create(ctx, "overflow", f);
+			llvm::BasicBlock *body = llvm::BasicBlock::Create(ctx, "body", f);
+			b.CreateCondBr(b.CreateICmpULT(sp, b.getInt64((uint64_t)mHostLimit)), overflow, body);
+			b.SetInsertPoint(overflow);
+			hook((void *)mHooks.overflow, b.getVoidTy(), {i8p}, {env});
+			b.CreateUnreachable();
+			b.SetInsertPoint(body);
+		}
+		llvm::Value *arrays = nullptr;
+		if (fn.arrayBytes)
+			arrays = hook((void *)mHooks.pushArrays, i8p, {i8p, i64}, {env, b.getInt64(fn.arrayBytes)});
+
+		std::vector<llvm::BasicBlock *> blocks(fn.code.size() + 1, nullptr);
+		auto leader = [&](size_t pc){
+			if (pc <= fn.code.size() && !blocks[pc])
+				blocks[pc] = llvm::BasicBlock::Create(ctx, "pc" + std::to_string(pc), f);
+		};
+		leader(0);
+		for (size_t pc = 0; pc < fn.code.size(); pc++){
+			const Insn &I = fn.code[pc];
+			if (I.op == OP_JMP)
+				leader(I.a);
+			else if (I.op == OP_JZ || I.op == OP_JNZ)
+				leader(I.b);
+			else if (I.op >= OP_JLT && I.op <= OP_JNEI)
+				leader(I.c);
+			else if (I.op != OP_RET)
+				continue;
+			leader(pc + 1);
+		}
+		b.CreateBr(blocks[0]);
+
+		auto R = [&](int32_t r){
+			return b.CreateLoad(i64, regs[r]);
+		};
+		auto set = [&](int32_t r, llvm::Value *val){
+			b.CreateStore(val, regs[r]);
+		};
+		/// The address of base[index], once it is known to lie in GuestMemory
+		auto elemPtr = [&](llvm::Type *elem, llvm::Value *base, llvm::Value *index){
+			int64_t width = elem->getIntegerBitWidth() / 8;
+			llvm::Value *addr = b.CreateAdd(base, b.CreateMul(index, b.getInt64(width)));
+			llvm::Value *offset = b.CreateSub(addr, b.getInt64((uint64_t)mMemory.base()));
+			llvm::BasicBlock *fault = llvm::BasicBlock::Create(ctx, "fault", f);
+			llvm::BasicBlock *access = llvm::BasicBlock::Create(ctx, "access", f);
+			b.CreateCondBr(b.CreateICmpUGT(offset, b.getInt64(mMemory.bytes() - width)), fault, access);
+			b.SetInsertPoint(fault);
+			hook((void *)mHooks.fault, b.getVoidTy(), {i64}, {addr});
+			b.CreateUnreachable();
+			b.SetInsertPoint(access);
+			return b.CreateIntToPtr(addr, elem->getPointerTo());
+		};
+		auto load = [&](Opcode first, Opcode op, llvm::Value *base, llvm::Value *index){
+			ElemKind kind = (ElemKind)(op - first);
+			llvm::Type *elem = b.getIntNTy(elemBytes(kind) * 8);
+			llvm::Value *val = b.CreateLoad(elem, elemPtr(elem, base, index));
+			if (kind == EK_I64)
+				return val;
+			return kind % 2 ? b.CreateZExt(val, i64) : b.CreateSExt(val, i64);
+		};
+		auto store = [&](Opcode first, Opcode op, llvm::Value *base, llvm::Value *index, llvm::Value *val){
+			llvm::Type *elem = b.getIntNTy(8 << (op - first));
+			b.CreateStore(b.CreateTrunc(val, elem), elemPtr(elem, base, index));
+		};
+		auto branch = [&](llvm::Value *cond, size_t target, size_t pc){
+			b.CreateCondBr(cond, blocks[target], blocks[pc + 1]);
+		};
+
+		for (size_t pc = 0; pc < fn.code.size(); pc++){
+			if (blocks[pc]){
+				if (!b.GetInsertBlock()->getTerminator())
+					b.CreateBr(blocks[pc]);
+				b.SetInsertPoint(blocks[pc]);
+			}
+			const Insn &I = fn.code[pc];
+			switch (I.op){
+			case OP_MOV: set(I.a, R(I.b)); break;
+			case OP_LOADI: set(I.a, b.getInt64(I.b)); break;
+			case OP_LOADK: set(I.a, b.getInt64(mProg.constants[I.b])); break;
+			case OP_GETG: set(I.a, b.CreateLoad(i64, b.CreateIntToPtr(b.getInt64((uint64_t)(mGlobals + I.b)), i64p))); break;
+			case OP_SETG: b.CreateStore(R(I.b), b.CreateIntToPtr(b.getInt64((uint64_t)(mGlobals + I.a)), i64p)); break;
+			case OP_ADD: set(I.a, b.CreateAdd(R(I.b), R(I.c))); break;
+			case OP_ADDI: set(I.a, b.CreateAdd(R(I.b), b.getInt64(I.c))); break;
+			case OP_SUB: set(I.a, b.CreateSub(R(I.b), R(I.c))); break;
+			case OP_MUL: set(I.a, b.CreateMul(R(I.b), R(I.c))); break;
+			case OP_MULI: set(I.a, b.CreateMul(R(I.b), b.getInt64(I.c))); break;
+			case OP_DIV:{
+				llvm::Value *divisor = R(I.c);
+				llvm::BasicBlock *zero = llvm::BasicBlock::Create(ctx, "divzero", f);
+				llvm::BasicBlock *divide = llvm::BasicBlock::Create(ctx, "div", f);
+				b.CreateCondBr(b.CreateICmpEQ(divisor, b.getInt64(0)), zero, divide);
+				b.SetInsertPoint(zero);
+				hook((void *)mHooks.divZero, b.getVoidTy(), {i8p}, {env});
+				b.CreateUnreachable();
+				b.SetInsertPoint(divide);
+				// INT64_MIN / -1 wraps as the VM's does; sdiv never sees -1
+				llvm::Value *minusOne = b.CreateICmpEQ(divisor, b.getInt64(-1));
+				llvm::Value *quotient = b.CreateSDiv(R(I.b), b.CreateSelect(minusOne, b.getInt64(1), divisor));
+				set(I.a, b.CreateSelect(minusOne, b.CreateNeg(R(I.b)), quotient));
+				break;
+			}
+			case OP_LT: set(I.a, b.CreateZExt(b.CreateICmpSLT(R(I.b), R(I.c)), i64)); break;
+			case OP_GT: set(I.a, b.CreateZExt(b.CreateICmpSGT(R(I.b), R(I.c)), i64)); break;
+			case OP_EQ: set(I.a, b.CreateZExt(b.CreateICmpEQ(R(I.b), R(I.c)), i64)); break;
+			case OP_LE: set(I.a, b.CreateZExt(b.CreateICmpSLE(R(I.b), R(I.c)), i64)); break;
+			case OP_GE: set(I.a, b.CreateZExt(b.CreateICmpSGE(R(I.b), R(I.c)), i64)); break;
+			case OP_NEG: set(I.a, b.CreateNeg(R(I.b))); break;
+			case OP_NOT: set(I.a, b.CreateNot(R(I.b))); break;
+			case OP_LNOT: set(I.a, b.CreateZExt(b.CreateICmpEQ(R(I.b), b.getInt64(0)), i64)); break;
+			case OP_LDELEM_I8: case OP_LDELEM_U8: case OP_LDELEM_I16: case OP_LDELEM_U16:
+			case OP_LDELEM_I32: case OP_LDELEM_U32: case OP_LDELEM_I64:
+				set(I.a, load(OP_LDELEM_I8, I.op, R(I.b), R(I.c)));
+				break;
+			case OP_STELEM_I8: case OP_STELEM_I16: case OP_STELEM_I32: case OP_STELEM_I64:
+				store(OP_STELEM_I8, I.op, R(I.a), R(I.b), R(I.c));
+				break;
+			case OP_LOAD_I8: case OP_LOAD_U8: case OP_LOAD_I16: case OP_LOAD_U16:
+			case OP_LOAD_I32: case OP_LOAD_U32: case OP_LOAD_I64:
+				set(I.a, load(OP_LOAD_I8, I.op, R(I.b), b.getInt64(I.c)));
+				break;
+			case OP_STORE_I8: case OP_STORE_I16: case OP_STORE_I32: case OP_STORE_I64:
+				store(OP_STORE_I8, I.op, R(I.a), b.getInt64(I.c), R(I.b));
+				break;
+			case OP_ALLOCA:{
+				if (!arrays)
+					return false;
+				llvm::Value *array = b.CreateConstGEP1_64(b.getInt8Ty(), arrays, I.b);
+				if (I.c < InlineZeroBytes)
+					b.CreateMemSet(array, b.getInt8(0), I.c, llvm::MaybeAlign(8));
+				else
+					hook((void *)mHooks.zero, b.getVoidTy(), {i8p, i64}, {array, b.getInt64(I.c)});
+				set(I.a, b.CreatePtrToInt(array, i64));
+				break;
+			}
+			case OP_JMP: b.CreateBr(blocks[I.a]); break;
+			case OP_JZ: branch(b.CreateICmpEQ(R(I.a), b.getInt64(0)), I.b, pc); break;
+			case OP_JNZ: branch(b.CreateICmpNE(R(I.a), b.getInt64(0)), I.b, pc); break;
+			case OP_JLT: branch(b.CreateICmpSLT(R(I.a), R(I.b)), I.c, pc); break;
+			case OP_JLE: branch(b.CreateICmpSLE(R(I.a), R(I.b)), I.c, pc); break;
+			case OP_JEQ: branch(b.CreateICmpEQ(R(I.a), R(I.b)), I.c, pc); break;
+			case OP_JNE: branch(b.CreateICmpNE(R(I.a), R(I.b)), I.c, pc); break;
+			case OP_JLTI: branch(b.CreateICmpSLT(R(I.a), b.getInt64(I.b)), I.c, pc); break;
+			case OP_JGTI: branch(b.CreateICmpSGT(R(I.a), b.getInt64(I.b)), I.c, pc); break;
+			case OP_JEQI: branch(b.CreateICmpEQ(R(I.a), b.getInt64(I.b)), I.c, pc); break;
+			case OP_JNEI: branch(b.CreateICmpNE(R(I.a), b.getInt64(I.b)), I.c, pc); break;
+			case OP_VLOOP:{
+				for (int32_t r = 0; r < fn.numRegs; r++)
+					b.CreateStore(R(r), b.CreateConstGEP1_32(i64, spill, r));
+				hook((void *)mHooks.vecLoop, b.getVoidTy(), {i8p, i64, i64p, i64}, {env, b.getInt64(I.a), spill, R(I.b)});
+				int32_t index = mProg.vecLoops[I.a].index;
+				set(index, b.CreateLoad(i64, b.CreateConstGEP1_32(i64, spill, index)));
+				break;
+			}
+			case OP_CALL:{
+				// Straight into the callee once it is native, else back to the VM
+				for (int32_t i = 0; i < mProg.functions[I.b].numParams; i++)
+					b.CreateStore(R(I.c + i), b.CreateConstGEP1_32(i64, argv, i));
+				llvm::Value *slot = b.CreateIntToPtr(b.getInt64((uint64_t)&mNatives[I.b]), nativeTy->getPointerTo()->getPointerTo());
+				llvm::Value *native = b.CreateLoad(nativeTy->getPointerTo(), slot);
+				llvm::BasicBlock *direct = llvm::BasicBlock::Create(ctx, "native", f);
+				llvm::BasicBlock *interp = llvm::BasicBlock::Create(ctx, "interp", f);
+				llvm::BasicBlock *done = llvm::BasicBlock::Create(ctx, "called", f);
+				b.CreateCondBr(b.CreateIsNull(native), interp, direct);
+				b.SetInsertPoint(direct);
+				llvm::Value *fast = b.CreateCall(nativeTy, native, {argv});
+				b.CreateBr(done);
+				b.SetInsertPoint(interp);
+				llvm::Value *slow = hook((void *)mHooks.call, i64, {i8p, i64, i64p}, {env, b.getInt64(I.b), argv});
+				b.CreateBr(done);
+				b.SetInsertPoint(done);
+				llvm::PHINode *result = b.CreatePHI(i64, 2);
+				result->addIncoming(fast, direct);
+				result->addIncoming(slow, interp);
+				set(I.a, result);
+				break;
+			}
+			case OP_RET:
+				if (arrays)
+					hook((void *)mHooks.popArrays, b.getVoidTy(), {i8p, i8p}, {env, arrays});
+				b.CreateRet(R(I.a));
+				break;
+			case OP_GET: set(I.a, hook((void *)mHooks.get, i64, {i8p}, {env})); break;
+			case OP_PRINT: hook((void *)mHooks.print, b.getVoidTy(), {i8p, i64}, {env, R(I.a)}); break;
+			case OP_MALLOC: set(I.a, hook((void *)mHooks.malloc, i64, {i8p, i64, i64}, {env, R(I.b), b.getInt64(I.c)})); break;
+			case OP_FREE: hook((void *)mHooks.free, b.getVoidTy(), {i8p, i64}, {env, R(I.a)}); break;
+			default:
+				return false;
+			}
+		}
+		// Lowering ends every function with a return, so nothing runs off the end
+		if (!b.GetInsertBlock()->getTerminator())
+			b.CreateUnreachable();
+		if (blocks[fn.code.size()]){
+			b.SetInsertPoint(blocks[fn.code.size()]);
+			b.CreateUnreachable();
+		}
+		return !llvm::verifyFunction(*f, &llvm::errs());
+	}
+};
@@ -0,0 +1,812 @@
+#pragma once
+#include <map>
+#include <string>
+#include "Bytecode.h"
+#include "Environment.h"
+
+/// Thrown when a construct has no bytecode equivalent; the caller then
+/// falls back to the AST interpreter for the whole program.
+class LoweringError : public std::exception{
+	std::string mMsg;
+public:
+	explicit LoweringError(std::string msg) : mMsg(std::move(msg)){
+	}
+	const char *what() const noexcept override{
+		return mMsg.c_str();
+	}
+};
+
+/// Lowers the translation unit to a BCProgram once, after Environment::init
+/// has located the builtins and the entry point.
+class Lowering{
+	Environment &mEnv;
+	BCProgram &mProg;
+	/// Variables live in registers numbered by their SlotMap slot;
+	/// temporaries are allocated above them
+	const SlotMap &mSlots;
+	/// Function definitions, resolved to their program indices
+	std::map<FunctionDecl *, int32_t> mFuncs;
+	/// Whether calls to tiny leaf functions are expanded in place, and the
+	/// registers holding the parameters of the one being expanded
+	bool mInline;
+	llvm::DenseMap<const Decl *, int32_t> mInlineParams;
+
+	/// Per-function state
+	BCFunction *mFn;
+	int32_t mNextReg;
+	/// Line of the statement whose first instruction is emitted next
+	int32_t mLine;
+	/// Pending break/continue jumps of the enclosing loops
+	struct LoopJumps{
+		std::vector<int32_t> breaks;
+		std::vector<int32_t> continues;
+	};
+	std::vector<LoopJumps> mLoops;
+
+public:
+	Lowering(Environment &env, BCProgram &prog, bool inlineCalls = false)
+	    : mEnv(env), mProg(prog), mSlots(env.getSlots()), mInline(inlineCalls), mFn(NULL), mNextReg(0), mLine(0){
+	}
+
+	/// Returns false and fills err when some construct can't be lowered.
+	bool lower(TranslationUnitDecl *unit, std::string &err){
+		try{
+			lowerUnit(unit);
+		} catch (LoweringError &e){
+			err = e.what();
+			return false;
+		}
+		return true;
+	}
+
+private:
+	void lowerUnit(TranslationUnitDecl *unit){
+		if (!mEnv.getEntry() || !mEnv.getEntry()->hasBody())
+			throw LoweringError("no definition of main");
+		std::vector<FunctionDecl *> bodies;
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)){
+				if (fdecl->doesThisDeclarationHaveABody()){
+					mFuncs[fdecl] = mProg.functions.size();
+					mProg.functions.push_back(BCFunction());
+					mProg.functions.back().name = fdecl->getNameAsString();
+					bodies.push_back(fdecl);
+				}
+			}
+		}
+		mProg.numGlobals = mSlots.numGlobals();
+		for (FunctionDecl *fdecl : bodies)
+			lowerFunction(fdecl);
+
+		/// Globals are initialized by a synthetic entry function that then calls main
+		mProg.entry = mProg.functions.size();
+		mProg.functions.push_back(BCFunction());
+		beginFunction(&mProg.functions.back(), "<init>", 0);
+		/// Global arrays live in the frame of <init>, which outlasts main
+		mFn->arrayBytes = mSlots.globalArrayBytes();
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(*i)){
+				int32_t global = mSlots.lookup(vardecl)->index;
+				int32_t mark = mNextReg;
+				int64_t val;
+				if (vardecl->getType()->isArrayType())
+					emit(OP_SETG, global, lowerArray(vardecl));
+				else if (vardecl->hasInit() && constant(vardecl->getInit(), val))
+					emit(OP_SETG, global, loadConst(val, -1));
+				else if (vardecl->hasInit())
+					emit(OP_SETG, global, lowerExpr(vardecl->getInit()));
+				mNextReg = mark;
+			}
+		}
+		int32_t ret = newReg();
+		emit(OP_CALL, ret, mFuncs[mEnv.getEntry()->getDefinition()], 0);
+		emit(OP_RET, ret);
+	}
+
+	void beginFunction(BCFunction *fn, const std::string &name, int32_t numSlots){
+		mFn = fn;
+		mFn->name = name;
+		mFn->numRegs = numSlots;
+		mNextReg = numSlots;
+	}
+
+	void lowerFunction(FunctionDecl *fdecl){
+		beginFunction(&mProg.functions[mFuncs[fdecl]], fdecl->getNameAsString(), mSlots.frameSize(fdecl));
+		mFn->arrayBytes = mSlots.frameArrayBytes(fdecl);
+		mFn->numParams = fdecl->getNumParams();
+		mFn->pure = mEnv.isPure(fdecl);
+		lowerStmt(fdecl->getBody());
+		/// Falling off the end returns 0, as the AST interpreter does
+		int32_t zero = newReg();
+		emit(OP_LOADI, zero, 0);
+		emit(OP_RET, zero);
+	}
+
+	int32_t newReg(){
+		int32_t reg = mNextReg++;
+		if (mNextReg > mFn->numRegs)
+			mFn->numRegs = mNextReg;
+		return reg;
+	}
+
+	int32_t target(int32_t dst){
+		return dst >= 0 ? dst : newReg();
+	}
+
+	int32_t emit(Opcode op, int32_t a = 0, int32_t b = 0, int32_t c = 0){
+		mFn->code.push_back(Insn{op, a, b, c});
+		mFn->lines.push_back(mLine);
+		mLine = 0;
+		return mFn->code.size() - 1;
+	}
+
+	int32_t here(){
+		return mFn->code.size();
+	}
+
+	void patch(int32_t jump, int32_t dest){
+		Insn &insn = mFn->code[jump];
+		if (insn.op == OP_JMP)
+			insn.a = dest;
+		else if (insn.op == OP_JZ || insn.op == OP_JNZ)
+			insn.b = dest;
+		else
+			insn.c = dest;
+	}
+
+	[[noreturn]] void unsupported(Stmt *stmt){
+		throw LoweringError(std::string("can't lower ") + stmt->getStmtClassName());
+	}
+
+	void lowerStmt(Stmt *stmt){
+		if (!isa<CompoundStmt>(stmt))
+			mLine = mEnv.lineOf(stmt);
+		if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt)){
+			lowerDecl(declstmt);
+			return;
+		}
+		/// Temporaries die with the statement
+		int32_t mark = mNextReg;
+		if (CompoundStmt *compound = dyn_cast<CompoundStmt>(stmt)){
+			for (CompoundStmt::body_iterator i = compound->body_begin(), e = compound->body_end(); i != e; ++i)
+				lowerStmt(*i);
+		}
+		else if (IfStmt *ifstmt = dyn_cast<IfStmt>(stmt)){
+			int32_t jz = lowerBranch(ifstmt->getCond(), false);
+			lowerStmt(ifstmt->getThen());
+			if (ifstmt->getElse()){
+				int32_t jmp = emit(OP_JMP);
+				patch(jz, here());
+				lowerStmt(ifstmt->getElse());
+				patch(jmp, here());
+			}
+			else
+				patch(jz, here());
+		}
+		else if (WhileStmt *whilestmt = dyn_cast<WhileStmt>(stmt))
+			lowerLoop(whilestmt->getCond(), whilestmt->getBody(), NULL);
+		else if (ForStmt *forstmt = dyn_cast<ForStmt>(stmt)){
+			if (forstmt->getInit())
+				lowerStmt(forstmt->getInit());
+			if (const VecPlan *plan = mEnv.vectorPlan(forstmt)){
+				emit(OP_VLOOP, mProg.vecLoops.size(), lowerExpr(plan->bound));
+				mProg.vecLoops.push_back(plan->loop);
+			}
+			else
+				lowerLoop(forstmt->getCond(), forstmt->getBody(), forstmt->getInc());
+		}
+		else if (isa<BreakStmt>(stmt) || isa<ContinueStmt>(stmt)){
+			if (mLoops.empty())
+				unsupported(stmt);
+			if (isa<BreakStmt>(stmt))
+				mLoops.back().breaks.push_back(emit(OP_JMP));
+			else
+				mLoops.back().continues.push_back(emit(OP_JMP));
+		}
+		else if (ReturnStmt *ret = dyn_cast<ReturnStmt>(stmt)){
+			if (ret->getRetValue())
+				emit(OP_RET, lowerExpr(ret->getRetValue()));
+			else{
+				int32_t zero = newReg();
+				emit(OP_LOADI, zero, 0);
+				emit(OP_RET, zero);
+			}
+		}
+		else if (isa<NullStmt>(stmt)){
+		}
+		else if (Expr *expr = dyn_cast<Expr>(stmt))
+			lowerExpr(expr);
+		else
+			unsupported(stmt);
+		mNextReg = mark;
+	}
+
+	/// Loops whose condition compares two variables or constants are
+	/// rotated: the condition is tested once on entry and then at the
+	/// bottom, so an iteration ends in a single compare-and-branch instead
+	/// of a compare, a branch and a jump back
+	void lowerLoop(Expr *cond, Stmt *body, Stmt *inc){
+		bool rotate = cond && simpleComparison(cond);
+		int32_t top = here();
+		int32_t exit = cond ? lowerBranch(cond, false) : -1;
+		if (rotate)
+			top = here();
+		mLoops.push_back(LoopJumps());
+		lowerStmt(body);
+		int32_t next = here();
+		if (inc)
+			lowerStmt(inc);
+		if (rotate)
+			patch(lowerBranch(cond, true), top);
+		else
+			emit(OP_JMP, top);
+		if (exit >= 0)
+			patch(exit, here());
+		endLoop(next, here());
+	}
+
+	void endLoop(int32_t continueTarget, int32_t breakTarget){
+		for (int32_t jump : mLoops.back().continues)
+			patch(jump, continueTarget);
+		for (int32_t jump : mLoops.back().breaks)
+			patch(jump, breakTarget);
+		mLoops.pop_back();
+	}
+
+	void lowerDecl(DeclStmt *declstmt){
+		for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++it){
+			VarDecl *vardecl = dyn_cast<VarDecl>(*it);
+			if (!vardecl)
+				continue;
+			QualType type = vardecl->getType();
+			int32_t reg = mSlots.lookup(vardecl)->index;
+			int32_t mark = mNextReg;
+			if (type->isIntegerType() || type->isPointerType()){
+				if (vardecl->hasInit())
+					lowerExprInto(vardecl->getInit(), reg);
+				else
+					emit(OP_LOADI, reg, 0);
+			}
+			else if (type->isArrayType())
+				lowerArray(vardecl, reg);
+			else
+				throw LoweringError("can't lower declaration of " + vardecl->getNameAsString());
+			mNextReg = mark;
+		}
+	}
+
+	int32_t lowerArray(VarDecl *vardecl, int32_t dst = -1){
+		const VarSlot *slot = mSlots.lookup(vardecl);
+		int64_t bytes = SlotMap::arrayBytes(vardecl);
+		if (!isa<ConstantArrayType>(vardecl->getType().getTypePtr()))
+			throw LoweringError("can't lower array " + vardecl->getNameAsString());
+		if (slot->arrayOffset + bytes > INT32_MAX)
+			throw LoweringError("array too large: " + vardecl->getNameAsString());
+		int32_t reg = target(dst);
+		emit(OP_ALLOCA, reg, (int32_t)slot->arrayOffset, (int32_t)bytes);
+		return reg;
+	}
+
+	int32_t loadConst(int64_t val, int32_t dst){
+		int32_t reg = target(dst);
+		if (val >= INT32_MIN && val <= INT32_MAX)
+			emit(OP_LOADI, reg, (int32_t)val);
+		else{
+			emit(OP_LOADK, reg, mProg.constants.size());
+			mProg.constants.push_back(val);
+		}
+		return reg;
+	}
+
+	static Expr *stripParens(Expr *expr){
+		expr = expr->IgnoreImpCasts();
+		while (ParenExpr *paren = dyn_cast<ParenExpr>(expr))
+			expr = paren->getSubExpr()->IgnoreImpCasts();
+		return expr;
+	}
+
+	static bool literal(Expr *expr, int64_t &val){
+		expr = stripParens(expr);
+		if (IntegerLiteral *intliteral = dyn_cast<IntegerLiteral>(expr))
+			val = intliteral->getValue().getSExtValue();
+		else if (CharacterLiteral *charliteral = dyn_cast<CharacterLiteral>(expr))
+			val = charliteral->getValue();
+		else
+			return false;
+		return true;
+	}
+
+	/// Folds an expression of literals, as global initializers usually are.
+	/// Arithmetic wraps as the VM's does; division is left to run.
+	static bool constant(Expr *expr, int64_t &val){
+		expr = stripParens(expr);
+		if (literal(expr, val))
+			return true;
+		if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr)){
+			if (!constant(uop->getSubExpr(), val))
+				return false;
+			switch (uop->getOpcode()){
+			case UO_Plus: return true;
+			case UO_Minus: val = (int64_t)(0 - (uint64_t)val); return true;
+			case UO_Not: val = ~val; return true;
+			case UO_LNot: val = !val; return true;
+			default: return false;
+			}
+		}
+		BinaryOperator *bop = dyn_cast<BinaryOperator>(expr);
+		int64_t left, right;
+		if (!bop || !constant(bop->getLHS(), left) || !constant(bop->getRHS(), right))
+			return false;
+		switch (bop->getOpcode()){
+		case BO_Add: val = (int64_t)((uint64_t)left + (uint64_t)right); return true;
+		case BO_Sub: val = (int64_t)((uint64_t)left - (uint64_t)right); return true;
+		case BO_Mul: val = (int64_t)((uint64_t)left * (uint64_t)right); return true;
+		default: return false;
+		}
+	}
+
+	/// A comparison lowerBinary knows, or NULL
+	static BinaryOperator *comparison(Expr *expr){
+		BinaryOperator *bop = dyn_cast<BinaryOperator>(stripParens(expr));
+		if (!bop)
+			return NULL;
+		switch (bop->getOpcode()){
+		case BO_LT: case BO_GT: case BO_LE: case BO_GE: case BO_EQ:
+			return bop;
+		default:
+			return NULL;
+		}
+	}
+
+	/// A comparison of variables and constants, cheap to evaluate twice
+	static bool simpleComparison(Expr *expr){
+		BinaryOperator *bop = comparison(expr);
+		if (!bop)
+			return false;
+		int64_t val;
+		for (Expr *side : {bop->getLHS(), bop->getRHS()})
+			if (!isa<DeclRefExpr>(stripParens(side)) && !literal(side, val))
+				return false;
+		return true;
+	}
+
+	/// Emits a jump taken when cond is true (or false, for !when) and
+	/// returns it for patching. A comparison becomes one compare-and-branch,
+	/// against an immediate when one side is a small constant.
+	int32_t lowerBranch(Expr *cond, bool when){
+		BinaryOperator *bop = comparison(cond);
+		if (!bop)
+			return emit(when ? OP_JNZ : OP_JZ, lowerExpr(cond));
+		BinaryOperatorKind op = bop->getOpcode();
+		if (!when){
+			switch (op){
+			case BO_LT: op = BO_GE; break;
+			case BO_GT: op = BO_LE; break;
+			case BO_LE: op = BO_GT; break;
+			case BO_GE: op = BO_LT; break;
+			default: op = BO_NE; break;
+			}
+		}
+		Expr *left = bop->getLHS();
+		Expr *right = bop->getRHS();
+		int64_t k;
+		if (literal(left, k) && !literal(right, k)){
+			/// 5 < x is x > 5
+			std::swap(left, right);
+			switch (op){
+			case BO_LT: op = BO_GT; break;
+			case BO_GT: op = BO_LT; break;
+			case BO_LE: op = BO_GE; break;
+			case BO_GE: op = BO_LE; break;
+			default: break;
+			}
+		}
+		if (literal(right, k)){
+			/// x <= k is x < k + 1 and x >= k is x > k - 1
+			Opcode imm = op == BO_LT || op == BO_LE ? OP_JLTI : op == BO_GT || op == BO_GE ? OP_JGTI : op == BO_EQ ? OP_JEQI : OP_JNEI;
+			k += op == BO_LE ? 1 : op == BO_GE ? -1 : 0;
+			if (k >= INT32_MIN && k <= INT32_MAX)
+				return emit(imm, lowerExpr(left), (int32_t)k);
+		}
+		int32_t a = lowerExpr(left);
+		int32_t b = lowerExpr(right);
+		switch (op){
+		case BO_LT: return emit(OP_JLT, a, b);
+		case BO_LE: return emit(OP_JLE, a, b);
+		case BO_GT: return emit(OP_JLT, b, a);
+		case BO_GE: return emit(OP_JLE, b, a);
+		case BO_EQ: return emit(OP_JEQ, a, b);
+		default: return emit(OP_JNE, a, b);
+		}
+	}
+
+	int32_t lowerExprInto(Expr *expr, int32_t dst){
+		int32_t reg = lowerExpr(expr, dst);
+		if (reg != dst)
+			emit(OP_MOV, dst, reg);
+		return dst;
+	}
+
+	/// Returns the register holding the value of expr. When dst is given the
+	/// result is computed there if convenient; leaves such as locals are
+	/// returned in place and must not be written by the caller.
+	int32_t lowerExpr(Expr *expr, int32_t dst = -1){
+		expr = expr->IgnoreImpCasts();
+		if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(expr)){
+			auto param = mInlineParams.find(declref->getDecl());
+			if (param != mInlineParams.end())
+				return param->second;
+			const VarSlot *slot = mSlots.lookup(declref->getFoundDecl());
+			if (!slot)
+				throw LoweringError("unresolved reference to " + declref->getFoundDecl()->getNameAsString());
+			if (!slot->global)
+				return slot->index;
+			int32_t reg = target(dst);
+			emit(OP_GETG, reg, slot->index);
+			return reg;
+		}
+		else if (IntegerLiteral *intliteral = dyn_cast<IntegerLiteral>(expr))
+			return loadConst(intliteral->getValue().getSExtValue(), dst);
+		else if (CharacterLiteral *charliteral = dyn_cast<CharacterLiteral>(expr))
+			return loadConst(charliteral->getValue(), dst);
+		else if (ParenExpr *paren = dyn_cast<ParenExpr>(expr))
+			return lowerExpr(paren->getSubExpr(), dst);
+		else if (CStyleCastExpr *cast = dyn_cast<CStyleCastExpr>(expr))
+			return lowerExpr(cast->getSubExpr(), dst);
+		else if (UnaryExprOrTypeTraitExpr *ueot = dyn_cast<UnaryExprOrTypeTraitExpr>(expr)){
+			if (ueot->getKind() != UETT_SizeOf)
+				unsupported(expr);
+			return loadConst(8, dst);
+		}
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr))
+			return lowerUnary(uop, dst);
+		else if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr))
+			return lowerBinary(bop, dst);
+		else if (ArraySubscriptExpr *array = dyn_cast<ArraySubscriptExpr>(expr))
+			return emitLoad(lowerAccess(array->getBase(), array->getIdx(), SlotMap::elemKind(array->getType())), dst);
+		else if (CallExpr *call = dyn_cast<CallExpr>(expr))
+			return lowerCall(call, dst);
+		unsupported(expr);
+	}
+
+	/// Where a load or store goes: base[index], or base[offset] when the
+	/// index is a small constant
+	struct Access{
+		int32_t base;
+		int32_t index;
+		int32_t offset;
+		ElemKind kind;
+	};
+
+	static bool isPointer(Expr *expr){
+		return expr->getType()->isPointerType() || expr->getType()->isArrayType();
+	}
+
+	/// Lowers pointer[index], or *pointer when index is NULL, evaluating
+	/// the operands in source order
+	Access lowerAccess(Expr *pointer, Expr *index, ElemKind kind, bool indexFirst = false){
+		Access access = {-1, -1, 0, kind};
+		int64_t k = 0;
+		if (!index || (literal(index, k) && k >= INT32_MIN && k <= INT32_MAX)){
+			access.base = lowerExpr(pointer);
+			access.offset = (int32_t)k;
+			return access;
+		}
+		if (indexFirst)
+			access.index = lowerExpr(index);
+		access.base = lowerExpr(pointer);
+		if (!indexFirst)
+			access.index = lowerExpr(index);
+		return access;
+	}
+
+	/// *(p + i) is accessed as p[i]
+	Access lowerDeref(UnaryOperator *uop){
+		ElemKind kind = SlotMap::elemKind(uop->getType());
+		BinaryOperator *add = dyn_cast<BinaryOperator>(stripParens(uop->getSubExpr()));
+		if (add && add->getOpcode() == BO_Add && isPointer(add->getLHS()) != isPointer(add->getRHS())){
+			if (isPointer(add->getLHS()))
+				return lowerAccess(add->getLHS(), add->getRHS(), kind);
+			return lowerAccess(add->getRHS(), add->getLHS(), kind, true);
+		}
+		return lowerAccess(uop->getSubExpr(), NULL, kind);
+	}
+
+	int32_t emitLoad(const Access &access, int32_t dst){
+		int32_t reg = target(dst);
+		if (access.index < 0)
+			emit(loadOp(access.kind), reg, access.base, access.offset);
+		else
+			emit(ldelemOp(access.kind), reg, access.base, access.index);
+		return reg;
+	}
+
+	void emitStore(const Access &access, int32_t val){
+		if (access.index < 0)
+			emit(storeOp(access.kind), access.base, val, access.offset);
+		else
+			emit(stelemOp(access.kind), access.base, access.index, val);
+	}
+
+	int32_t lowerUnary(UnaryOperator *uop, int32_t dst){
+		if (uop->getOpcode() == UO_Deref)
+			return emitLoad(lowerDeref(uop), dst);
+		Opcode op;
+		switch (uop->getOpcode()){
+		case UO_Plus:
+			return lowerExpr(uop->getSubExpr(), dst);
+		case UO_Minus:
+			op = OP_NEG;
+			break;
+		case UO_Not:
+			op = OP_NOT;
+			break;
+		case UO_LNot:
+			op = OP_LNOT;
+			break;
+		default:
+			unsupported(uop);
+		}
+		int32_t sub = lowerExpr(uop->getSubExpr());
+		int32_t reg = target(dst);
+		emit(op, reg, sub);
+		return reg;
+	}
+
+	int32_t lowerBinary(BinaryOperator *bop, int32_t dst){
+		if (bop->getOpcode() == BO_Assign)
+			return lowerAssign(bop, dst);
+		Opcode op;
+		switch (bop->getOpcode()){
+		case BO_Add:
+			op = OP_ADD;
+			break;
+		case BO_Sub:
+			op = OP_SUB;
+			break;
+		case BO_Mul:
+			op = OP_MUL;
+			break;
+		case BO_Div:
+			op = OP_DIV;
+			break;
+		case BO_LT:
+			op = OP_LT;
+			break;
+		case BO_GT:
+			op = OP_GT;
+			break;
+		case BO_EQ:
+			op = OP_EQ;
+			break;
+		case BO_LE:
+			op = OP_LE;
+			break;
+		case BO_GE:
+			op = OP_GE;
+			break;
+		default:
+			unsupported(bop);
+		}
+		if ((op == OP_ADD || op == OP_SUB) && (isPointer(bop->getLHS()) || isPointer(bop->getRHS())))
+			return lowerPointerArith(bop, op, dst);
+		/// Adding or subtracting a small constant takes one instruction
+		if (op == OP_ADD || op == OP_SUB){
+			Expr *var = NULL;
+			int64_t k;
+			if (literal(bop->getRHS(), k)){
+				var = bop->getLHS();
+				if (op == OP_SUB && k > INT64_MIN)
+					k = -k;
+			}
+			else if (op == OP_ADD && literal(bop->getLHS(), k))
+				var = bop->getRHS();
+			if (var && k >= INT32_MIN && k <= INT32_MAX){
+				int32_t src = lowerExpr(var);
+				int32_t reg = target(dst);
+				emit(OP_ADDI, reg, src, (int32_t)k);
+				return reg;
+			}
+		}
+		int32_t left = lowerExpr(bop->getLHS());
+		int32_t right = lowerExpr(bop->getRHS());
+		int32_t reg = target(dst);
+		emit(op, reg, left, right);
+		return reg;
+	}
+
+	/// Pointers step by the width of what they point to; the difference of
+	/// two pointers counts elements
+	int32_t lowerPointerArith(BinaryOperator *bop, Opcode op, int32_t dst){
+		Expr *left = bop->getLHS();
+		Expr *right = bop->getRHS();
+		bool leftPointer = isPointer(left);
+		int64_t stride = elemBytes(SlotMap::pointeeKind(leftPointer ? left : right));
+		int64_t k;
+		if (leftPointer && isPointer(right)){
+			int32_t l = lowerExpr(left);
+			int32_t r = lowerExpr(right);
+			int32_t reg = target(dst);
+			emit(OP_SUB, reg, l, r);
+			if (stride > 1)
+				emit(OP_DIV, reg, reg, loadConst(stride, -1));
+			return reg;
+		}
+		if (literal(leftPointer ? right : left, k) && k >= INT32_MIN / 8 && k <= INT32_MAX / 8){
+			int32_t pointer = lowerExpr(leftPointer ? left : right);
+			int32_t reg = target(dst);
+			emit(OP_ADDI, reg, pointer, (int32_t)(op == OP_SUB ? -k * stride : k * stride));
+			return reg;
+		}
+		int32_t l = lowerExpr(left);
+		int32_t r = lowerExpr(right);
+		int32_t index = leftPointer ? r : l;
+		if (stride > 1){
+			int32_t scaled = newReg();
+			emit(OP_MULI, scaled, index, (int32_t)stride);
+			index = scaled;
+		}
+		int32_t reg = target(dst);
+		emit(op, reg, leftPointer ? l : index, leftPointer ? index : r);
+		return reg;
+	}
+
+	int32_t lowerAssign(BinaryOperator *bop, int32_t dst){
+		Expr *left = bop->getLHS();
+		if (DeclRefExpr *declref = dyn_cast<DeclRefExpr>(left)){
+			const VarSlot *slot = mSlots.lookup(declref->getFoundDecl());
+			if (!slot)
+				unsupported(bop);
+			if (!slot->global)
+				return lowerExprInto(bop->getRHS(), slot->index);
+			int32_t val = lowerExpr(bop->getRHS(), dst);
+			emit(OP_SETG, slot->index, val);
+			return val;
+		}
+		else if (ArraySubscriptExpr *array = dyn_cast<ArraySubscriptExpr>(left)){
+			Access access = lowerAccess(array->getBase(), array->getIdx(), SlotMap::elemKind(array->getType()));
+			int32_t val = lowerExpr(bop->getRHS(), dst);
+			emitStore(access, val);
+			return val;
+		}
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(left)){
+			if (uop->getOpcode() != UO_Deref)
+				unsupported(bop);
+			Access access = lowerDeref(uop);
+			int32_t val = lowerExpr(bop->getRHS(), dst);
+			emitStore(access, val);
+			return val;
+		}
+		unsupported(bop);
+	}
+
+	int32_t lowerCall(CallExpr *call, int32_t dst){
+		FunctionDecl *callee = call->getDirectCallee();
+		if (!callee)
+			unsupported(call);
+		if (callee == mEnv.getInput()){
+			int32_t reg = target(dst);
+			emit(OP_GET, reg);
+			return reg;
+		}
+		else if (callee == mEnv.getOutput()){
+			int32_t val = lowerExpr(call->getArg(0));
+			emit(OP_PRINT, val);
+			return val;
+		}
+		else if (callee == mEnv.getMalloc()){
+			int32_t size = lowerExpr(call->getArg(0));
+			int32_t reg = target(dst);
+			mProg.allocSites.push_back(mEnv.allocSiteName(call));
+			emit(OP_MALLOC, reg, size, (int32_t)mProg.allocSites.size() - 1);
+			return reg;
+		}
+		else if (callee == mEnv.getFree()){
+			int32_t ptr = lowerExpr(call->getArg(0));
+			emit(OP_FREE, ptr);
+			return ptr;
+		}
+		else if (callee == mEnv.getSnapshot()){
+			emit(OP_SNAPSHOT);
+			/// SNAPSHOT() returns 0, in the run that took it and the restored one
+			int32_t reg = target(dst);
+			emit(OP_LOADI, reg, 0);
+			return reg;
+		}
+		else if (callee == mEnv.getSpawn()){
+			auto func = mFuncs.find(Environment::spawnTarget(call));
+			if (func == mFuncs.end())
+				unsupported(call);
+			int32_t arg = lowerExpr(call->getArg(1));
+			int32_t reg = target(dst);
+			emit(OP_SPAWN, reg, func->second, arg);
+			return reg;
+		}
+		else if (callee == mEnv.getJoin()){
+			int32_t handle = lowerExpr(call->getArg(0));
+			int32_t reg = target(dst);
+			emit(OP_JOIN, reg, handle);
+			return reg;
+		}
+		else if (callee == mEnv.getAtomicAdd() || callee == mEnv.getAtomicCas()){
+			bool add = callee == mEnv.getAtomicAdd();
+			bool wide;
+			switch (SlotMap::pointeeKind(call->getArg(0)->IgnoreParenImpCasts())){
+			case EK_I32: case EK_U32: wide = false; break;
+			case EK_I64: wide = true; break;
+			default: unsupported(call);
+			}
+			int32_t ptr = lowerExpr(call->getArg(0));
+			/// ATOMIC_CAS's expected and desired values go in consecutive registers
+			int32_t vals = mNextReg;
+			for (unsigned i = 1; i < call->getNumArgs(); i++)
+				newReg();
+			for (unsigned i = 1; i < call->getNumArgs(); i++)
+				lowerExprInto(call->getArg(i), vals + i - 1);
+			int32_t reg = target(dst);
+			if (add)
+				emit(wide ? OP_XADD_I64 : OP_XADD_I32, reg, ptr, vals);
+			else
+				emit(wide ? OP_CAS_I64 : OP_CAS_I32, reg, ptr, vals);
+			return reg;
+		}
+		auto func = mFuncs.find(callee->getDefinition());
+		if (func == mFuncs.end())
+			throw LoweringError("call to undefined function " + callee->getNameAsString());
+		if (call->getNumArgs() != callee->getNumParams())
+			unsupported(call);
+		if (Expr *body = inlineBody(func->first))
+			return lowerInline(call, func->first, body, dst);
+		/// Arguments are evaluated into consecutive registers
+		int32_t args = mNextReg;
+		for (unsigned i = 0; i < call->getNumArgs(); i++)
+			newReg();
+		for (unsigned i = 0; i < call->getNumArgs(); i++)
+			lowerExprInto(call->getArg(i), args + i);
+		int32_t reg = target(dst);
+		emit(OP_CALL, reg, func->second, args);
+		return reg;
+	}
+
+	/// The returned expression of a function whose body is just
+	/// `return expr;` over its parameters, globals and constants, or NULL.
+	/// Such a function calls nothing, so expanding it can't recurse.
+	Expr *inlineBody(FunctionDecl *fdecl){
+		if (!mInline)
+			return NULL;
+		CompoundStmt *body = dyn_cast<CompoundStmt>(fdecl->getBody());
+		if (!body || body->size() != 1)
+			return NULL;
+		ReturnStmt *ret = dyn_cast<ReturnStmt>(body->body_front());
+		if (!ret || !ret->getRetValue() || !leaf(ret->getRetValue()))
+			return NULL;
+		return ret->getRetValue();
+	}
+
+	static bool leaf(Stmt *stmt){
+		if (isa<CallExpr>(stmt))
+			return false;
+		if (BinaryOperator *bop = dyn_cast<BinaryOperator>(stmt))
+			if (bop->isAssignmentOp())
+				return false;
+		for (Stmt *child : stmt->children())
+			if (child && !leaf(child))
+				return false;
+		return true;
+	}
+
+	/// Evaluates the arguments as a call would, then the callee's return
+	/// expression with its parameters bound to them
+	int32_t lowerInline(CallExpr *call, FunctionDecl *fdecl, Expr *body, int32_t dst){
+		std::vector<int32_t> args;
+		for (unsigned i = 0; i < call->getNumArgs(); i++){
+			args.push_back(newReg());
+			lowerExprInto(call->getArg(i), args.back());
+		}
+		for (unsigned i = 0; i < call->getNumArgs(); i++)
+			mInlineParams[fdecl->getParamDecl(i)] = args[i];
+		int32_t reg = lowerExpr(body, dst);
+		mInlineParams.clear();
+		return reg;
+	}
+};
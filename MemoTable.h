@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Bounded argument->result cache for calls to pure guest functions
+/// (--memoize). The table is direct-mapped: a new result simply replaces
+/// whatever shared its slot, so memory stays fixed however many distinct
+/// calls a program makes. Functions taking more than MaxArgs parameters
+/// are never cached.
+class MemoTable{
+public:
+	static const int32_t MaxArgs = 4;
+
+private:
+	struct Entry{
+		/// Function id + 1; 0 marks an empty slot
+		int32_t fn;
+		int32_t numArgs;
+		int64_t args[MaxArgs];
+		int64_t result;
+	};
+	struct Function{
+		std::string name;
+		int64_t lookups;
+		int64_t hits;
+	};
+
+	std::vector<Entry> mEntries;
+	size_t mMask;
+	std::vector<Function> mFunctions;
+	int64_t mStores;
+	int64_t mEvictions;
+
+public:
+	/// Rounds entries up to a power of two
+	explicit MemoTable(size_t entries) : mStores(0), mEvictions(0){
+		size_t size = 1;
+		while (size < entries)
+			size <<= 1;
+		mEntries.assign(size, Entry());
+		mMask = size - 1;
+	}
+
+	static bool fits(int32_t numArgs){
+		return numArgs <= MaxArgs;
+	}
+
+	int32_t addFunction(const std::string &name){
+		mFunctions.push_back(Function{name, 0, 0});
+		return mFunctions.size() - 1;
+	}
+
+	bool lookup(int32_t fn, const int64_t *args, int32_t numArgs, int64_t &result){
+		mFunctions[fn].lookups++;
+		const Entry &entry = mEntries[slot(fn, args, numArgs)];
+		if (!matches(entry, fn, args, numArgs))
+			return false;
+		mFunctions[fn].hits++;
+		result = entry.result;
+		return true;
+	}
+
+	void store(int32_t fn, const int64_t *args, int32_t numArgs, int64_t result){
+		Entry &entry = mEntries[slot(fn, args, numArgs)];
+		if (entry.fn && !matches(entry, fn, args, numArgs))
+			mEvictions++;
+		entry.fn = fn + 1;
+		entry.numArgs = numArgs;
+		for (int32_t i = 0; i < numArgs; i++)
+			entry.args[i] = args[i];
+		entry.result = result;
+		mStores++;
+	}
+
+	void printStats(llvm::raw_ostream &os) const{
+		int64_t lookups = 0, hits = 0;
+		for (const Function &fn : mFunctions){
+			lookups += fn.lookups;
+			hits += fn.hits;
+		}
+		os << "memo: " << lookups << " lookups, " << hits << " hits" << rate(hits, lookups) << ", "
+		   << mStores << " stored, " << mEvictions << " evicted, " << mEntries.size() << " entries\n";
+		for (const Function &fn : mFunctions)
+			if (fn.lookups)
+				os << "  " << fn.name << ": " << fn.lookups << " lookups, " << fn.hits << " hits" << rate(fn.hits, fn.lookups) << "\n";
+	}
+
+private:
+	size_t slot(int32_t fn, const int64_t *args, int32_t numArgs) const{
+		uint64_t h = (uint64_t)(fn + 1) * 0x9e3779b97f4a7c15ull;
+		for (int32_t i = 0; i < numArgs; i++)
+			h = (h ^ (uint64_t)args[i]) * 0x9e3779b97f4a7c15ull;
+		return (h ^ (h >> 29)) & mMask;
+	}
+
+	static bool matches(const Entry &entry, int32_t fn, const int64_t *args, int32_t numArgs){
+		if (entry.fn != fn + 1 || entry.numArgs != numArgs)
+			return false;
+		for (int32_t i = 0; i < numArgs; i++)
+			if (entry.args[i] != args[i])
+				return false;
+		return true;
+	}
+
+	static std::string rate(int64_t hits, int64_t lookups){
+		if (!lookups)
+			return "";
+		std::string text;
+		llvm::raw_string_ostream os(text);
+		os << llvm::format(" (%.1f%%)", 100.0 * hits / lookups);
+		return os.str();
+	}
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Deterministic profiler for guest programs. Engines report every guest
+/// call and return and every statement they start; the profiler keeps the
+/// call tree with self time per node, call counts and inclusive/exclusive
+/// time per function, and execution counts per source line. Engines only
+/// call into it when profiling is on.
+class Profiler{
+	typedef std::chrono::steady_clock Clock;
+
+	struct Function{
+		std::string name;
+		int64_t calls;
+		int64_t selfNs;
+		int64_t totalNs;
+		/// Activations on the stack; only the outermost adds to totalNs
+		int32_t active;
+	};
+	struct Node{
+		int32_t parent;
+		int32_t fn;
+		int64_t selfNs;
+	};
+	struct Activation{
+		int32_t node;
+		Clock::time_point start;
+		int64_t childNs;
+	};
+
+	std::vector<Function> mFunctions;
+	std::vector<Node> mNodes;
+	llvm::DenseMap<std::pair<int32_t, int32_t>, int32_t> mChildren;
+	std::vector<Activation> mStack;
+	std::vector<int64_t> mLines;
+
+public:
+	int32_t addFunction(const std::string &name){
+		mFunctions.push_back(Function{name, 0, 0, 0, 0});
+		return mFunctions.size() - 1;
+	}
+
+	void enter(int32_t fn){
+		int32_t parent = mStack.empty() ? -1 : mStack.back().node;
+		auto child = mChildren.insert({{parent, fn}, (int32_t)mNodes.size()});
+		if (child.second)
+			mNodes.push_back(Node{parent, fn, 0});
+		mFunctions[fn].calls++;
+		mFunctions[fn].active++;
+		mStack.push_back(Activation{child.first->second, Clock::now(), 0});
+	}
+
+	void leave(){
+		Activation act = mStack.back();
+		mStack.pop_back();
+		int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - act.start).count();
+		Node &node = mNodes[act.node];
+		Function &fn = mFunctions[node.fn];
+		node.selfNs += ns - act.childNs;
+		fn.selfNs += ns - act.childNs;
+		if (--fn.active == 0)
+			fn.totalNs += ns;
+		if (!mStack.empty())
+			mStack.back().childNs += ns;
+	}
+
+	/// Closes activations a guest error left open
+	void finish(){
+		while (!mStack.empty())
+			leave();
+	}
+
+	void line(int32_t line){
+		if (line <= 0)
+			return;
+		if ((size_t)line >= mLines.size())
+			mLines.resize(line + 1);
+		mLines[line]++;
+	}
+
+	/// One "root;caller;callee self-nanoseconds" line per call path, the
+	/// folded format flamegraph.pl and speedscope read
+	void writeCollapsed(llvm::raw_ostream &os, const std::string &root = "") const{
+		for (size_t n = 0; n < mNodes.size(); n++){
+			if (!mNodes[n].selfNs)
+				continue;
+			std::vector<int32_t> path;
+			for (int32_t p = n; p >= 0; p = mNodes[p].parent)
+				path.push_back(mNodes[p].fn);
+			if (!root.empty())
+				os << root << ";";
+			for (size_t i = path.size(); i-- > 0;)
+				os << mFunctions[path[i]].name << (i ? ";" : " ");
+			os << mNodes[n].selfNs << "\n";
+		}
+	}
+
+	/// Functions by self time, then the most executed lines
+	void printSummary(llvm::raw_ostream &os, size_t maxLines = 20) const{
+		std::vector<size_t> order(mFunctions.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+			return mFunctions[a].selfNs > mFunctions[b].selfNs;
+		});
+		os << "profile:\n"
+		   << "       calls      self ms     total ms  function\n";
+		for (size_t i : order){
+			const Function &fn = mFunctions[i];
+			if (!fn.calls)
+				continue;
+			os << llvm::format("%12lld %12.3f %12.3f  ", (long long)fn.calls, fn.selfNs / 1e6, fn.totalNs / 1e6) << fn.name << "\n";
+		}
+		std::vector<std::pair<int64_t, int32_t>> lines;
+		for (size_t l = 0; l < mLines.size(); l++)
+			if (mLines[l])
+				lines.push_back({mLines[l], (int32_t)l});
+		std::sort(lines.begin(), lines.end(), [](const std::pair<int64_t, int32_t> &a, const std::pair<int64_t, int32_t> &b){
+			return a.first != b.first ? a.first > b.first : a.second < b.second;
+		});
+		if (lines.size() > maxLines)
+			lines.resize(maxLines);
+		os << "  executions  line\n";
+		for (auto &l : lines)
+			os << llvm::format("%12lld  %d\n", (long long)l.first, l.second);
+	}
+};
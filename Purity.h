@@ -0,0 +1,103 @@
+#pragma once
+#include <vector>
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+
+using namespace clang;
+
+/// Finds the guest functions whose result depends on nothing but their
+/// integer arguments, so a call can be answered from a MemoTable. A pure
+/// function takes and returns integers only, never touches a global or
+/// memory behind a pointer (its own local arrays are fine), and calls only
+/// pure functions. The builtins are declared without bodies, so a call to
+/// GET, PRINT, MALLOC, FREE or SNAPSHOT, like any other call to an undefined
+/// function, makes the caller impure.
+class PurityAnalysis{
+	llvm::DenseSet<const FunctionDecl *> mPure;
+
+public:
+	void analyze(TranslationUnitDecl *unit){
+		/// Functions that are pure if their callees are, and those callees
+		llvm::DenseMap<const FunctionDecl *, std::vector<const FunctionDecl *>> candidates;
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i);
+			if (!fdecl || !fdecl->doesThisDeclarationHaveABody() || !integerSignature(fdecl))
+				continue;
+			std::vector<const FunctionDecl *> callees;
+			if (clean(fdecl->getBody(), callees))
+				candidates[fdecl] = callees;
+		}
+		/// Drop candidates calling anything that isn't a candidate until
+		/// nothing changes; recursion among survivors is fine
+		bool changed = true;
+		while (changed){
+			changed = false;
+			for (auto it = candidates.begin(); it != candidates.end();){
+				auto cur = it++;
+				for (const FunctionDecl *callee : cur->second){
+					if (!candidates.count(callee)){
+						candidates.erase(cur);
+						changed = true;
+						break;
+					}
+				}
+			}
+		}
+		for (auto &candidate : candidates)
+			mPure.insert(candidate.first);
+	}
+
+	/// Whether fdecl, or the definition it refers to, is pure
+	bool isPure(const FunctionDecl *fdecl) const{
+		const FunctionDecl *def = fdecl->getDefinition();
+		return def && mPure.count(def);
+	}
+
+private:
+	static bool integerSignature(const FunctionDecl *fdecl){
+		if (!fdecl->getReturnType()->isIntegerType())
+			return false;
+		for (const ParmVarDecl *param : fdecl->parameters())
+			if (!param->getType()->isIntegerType())
+				return false;
+		return true;
+	}
+
+	/// Whether a local array declared in the function, not a global one
+	static bool localArray(Expr *base){
+		DeclRefExpr *ref = dyn_cast<DeclRefExpr>(base->IgnoreImpCasts());
+		if (!ref)
+			return false;
+		VarDecl *vardecl = dyn_cast<VarDecl>(ref->getDecl());
+		return vardecl && vardecl->getType()->isArrayType() && !vardecl->hasGlobalStorage();
+	}
+
+	/// Checks a body for effects and collects the definitions it calls
+	static bool clean(Stmt *stmt, std::vector<const FunctionDecl *> &callees){
+		if (DeclRefExpr *ref = dyn_cast<DeclRefExpr>(stmt)){
+			if (VarDecl *vardecl = dyn_cast<VarDecl>(ref->getDecl()))
+				if (vardecl->hasGlobalStorage())
+					return false;
+		}
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(stmt)){
+			if (uop->getOpcode() == UO_Deref || uop->getOpcode() == UO_AddrOf)
+				return false;
+		}
+		else if (ArraySubscriptExpr *subscript = dyn_cast<ArraySubscriptExpr>(stmt)){
+			if (!localArray(subscript->getBase()))
+				return false;
+		}
+		else if (CallExpr *callexpr = dyn_cast<CallExpr>(stmt)){
+			FunctionDecl *callee = callexpr->getDirectCallee();
+			if (!callee || !callee->getDefinition())
+				return false;
+			callees.push_back(callee->getDefinition());
+		}
+		for (Stmt *child : stmt->children())
+			if (child && !clean(child, callees))
+				return false;
+		return true;
+	}
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "llvm/ADT/DenseMap.h"
+#include "TypedAccess.h"
+
+using namespace clang;
+
+/// Where a variable lives: a fixed slot in its function's frame, or a
+/// global index. Arrays additionally own arrayOffset bytes into the array
+/// area that follows the slots of the frame (or of the globals).
+struct VarSlot{
+	int32_t index;
+	bool global;
+	int64_t arrayOffset;
+};
+
+/// Pre-pass giving every VarDecl/ParmVarDecl a fixed slot number in the
+/// frame of its function. Parameters take slots 0..n-1 in declaration
+/// order, locals follow in the order they appear in the body. Local arrays
+/// are laid out back to back in the frame, so they come and go with it.
+class SlotMap{
+	struct FrameLayout{
+		int32_t numSlots;
+		int64_t arrayBytes;
+	};
+	llvm::DenseMap<const Decl *, VarSlot> mSlots;
+	llvm::DenseMap<const FunctionDecl *, FrameLayout> mFrames;
+	int32_t mNumGlobals;
+	int64_t mGlobalArrayBytes;
+
+public:
+	SlotMap() : mNumGlobals(0), mGlobalArrayBytes(0){
+	}
+
+	/// How memory holds a value of type, as both engines load and store it
+	static ElemKind elemKind(QualType type){
+		if (!type->isIntegerType())
+			return EK_I64;
+		bool isSigned = type->isSignedIntegerType();
+		const BuiltinType *builtin = type->getAs<BuiltinType>();
+		switch (builtin ? builtin->getKind() : BuiltinType::Long){
+		case BuiltinType::Char_S: case BuiltinType::Char_U: case BuiltinType::SChar:
+		case BuiltinType::UChar: case BuiltinType::Bool:
+			return isSigned ? EK_I8 : EK_U8;
+		case BuiltinType::Short: case BuiltinType::UShort:
+			return isSigned ? EK_I16 : EK_U16;
+		case BuiltinType::Int: case BuiltinType::UInt:
+			return isSigned ? EK_I32 : EK_U32;
+		default:
+			return EK_I64;
+		}
+	}
+
+	/// Kind of the elements pointer (or array) expression expr points to
+	static ElemKind pointeeKind(const Expr *expr){
+		QualType type = expr->getType();
+		if (const PointerType *pointer = type->getAs<PointerType>())
+			return elemKind(pointer->getPointeeType());
+		if (const ArrayType *array = dyn_cast<ArrayType>(type.getTypePtr()))
+			return elemKind(array->getElementType());
+		return EK_I64;
+	}
+
+	/// Storage of a local array, keeping every array 8-byte aligned
+	static int64_t arrayBytes(const VarDecl *vardecl){
+		auto array = dyn_cast<ConstantArrayType>(vardecl->getType().getTypePtr());
+		if (!array)
+			return 0;
+		int64_t width = elemBytes(elemKind(array->getElementType()));
+		return (array->getSize().getSExtValue() * width + 7) & ~(int64_t)7;
+	}
+
+	void assign(TranslationUnitDecl *unit){
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i){
+			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)){
+				if (!fdecl->doesThisDeclarationHaveABody())
+					continue;
+				FrameLayout layout = {0, 0};
+				for (FunctionDecl::param_iterator p = fdecl->param_begin(), pe = fdecl->param_end(); p != pe; ++p)
+					mSlots[*p] = VarSlot{layout.numSlots++, false, -1};
+				collect(fdecl->getBody(), layout);
+				mFrames[fdecl] = layout;
+			}
+			else if (VarDecl *vardecl = dyn_cast<VarDecl>(*i))
+				mSlots[vardecl] = VarSlot{mNumGlobals++, true, place(vardecl, mGlobalArrayBytes)};
+		}
+	}
+
+	/// NULL for declarations that aren't variables, e.g. functions
+	const VarSlot *lookup(const Decl *decl) const{
+		auto it = mSlots.find(decl);
+		return it == mSlots.end() ? NULL : &it->second;
+	}
+
+	/// Number of slots a frame of fdecl (or any of its redeclarations) needs
+	int32_t frameSize(const FunctionDecl *fdecl) const{
+		auto it = mFrames.find(fdecl->getDefinition());
+		return it == mFrames.end() ? 0 : it->second.numSlots;
+	}
+
+	/// Bytes of local arrays a frame of fdecl needs after its slots
+	int64_t frameArrayBytes(const FunctionDecl *fdecl) const{
+		auto it = mFrames.find(fdecl->getDefinition());
+		return it == mFrames.end() ? 0 : it->second.arrayBytes;
+	}
+
+	int32_t numGlobals() const{
+		return mNumGlobals;
+	}
+
+	int64_t globalArrayBytes() const{
+		return mGlobalArrayBytes;
+	}
+
+private:
+	static int64_t place(const VarDecl *vardecl, int64_t &arrayBytes){
+		if (!vardecl->getType()->isArrayType())
+			return -1;
+		int64_t offset = arrayBytes;
+		arrayBytes += SlotMap::arrayBytes(vardecl);
+		return offset;
+	}
+
+	void collect(Stmt *stmt, FrameLayout &layout){
+		if (DeclStmt *declstmt = dyn_cast<DeclStmt>(stmt)){
+			for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++it)
+				if (VarDecl *vardecl = dyn_cast<VarDecl>(*it))
+					mSlots[vardecl] = VarSlot{layout.numSlots++, false, place(vardecl, layout.arrayBytes)};
+		}
+		for (Stmt *child : stmt->children())
+			if (child)
+				collect(child, layout);
+	}
+};
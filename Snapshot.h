@@ -0,0 +1,233 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "GuestHeap.h"
+#include "GuestStack.h"
+
+/// What a VM needs to carry on from a SNAPSHOT() call in a later run: the
+/// program it was running (by its BytecodeCache key), its globals, its call
+/// frames, the used parts of its guest stack and heap and their bookkeeping.
+/// Guest pointers are host addresses, so the restoring VM maps GuestMemory
+/// where the snapshotting one had it. GET input and PRINT output aren't
+/// part of a snapshot: a restored run reads input of its own.
+struct Snapshot{
+	/// Where a frame resumes: fn's code at pc, with registers at regs. The
+	/// bottom frame has fn -1.
+	struct Frame{
+		int64_t fn;
+		int64_t pc;
+		int64_t regs;
+		int64_t dst;
+	};
+
+	std::string key;
+	/// GuestMemory's base and sizes
+	uint64_t base = 0;
+	uint64_t stackBytes = 0;
+	uint64_t heapBytes = 0;
+	std::vector<int64_t> globals;
+	/// Bottom first; the last is the frame SNAPSHOT() ran in
+	std::vector<Frame> frames;
+	GuestStack::State stack = {};
+	GuestHeap::State heap = {};
+	/// The used parts of the stack and heap; a loaded snapshot points into data
+	llvm::StringRef stackImage;
+	llvm::StringRef heapImage;
+	std::unique_ptr<llvm::MemoryBuffer> data;
+
+	/// Written to a temporary file and renamed into place, so a run
+	/// restoring from path never sees half a snapshot
+	bool write(const std::string &path) const{
+		int fd;
+		llvm::SmallString<128> tmp;
+		if (llvm::sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tmp))
+			return false;
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			put(os, Magic);
+			put(os, Version);
+			put(os, key);
+			put(os, base);
+			put(os, stackBytes);
+			put(os, heapBytes);
+			put(os, globals.size());
+			for (int64_t g : globals)
+				put(os, g);
+			put(os, frames.size());
+			for (const Frame &frame : frames){
+				put(os, frame.fn);
+				put(os, frame.pc);
+				put(os, frame.regs);
+				put(os, frame.dst);
+			}
+			put(os, stack.bytesUsed);
+			put(os, stack.depth);
+			put(os, stack.peakDepth);
+			put(os, stack.peakBytes);
+			put(os, heap.bytesUsed);
+			put(os, heap.free.size());
+			for (int64_t head : heap.free)
+				put(os, head);
+			put(os, heap.large.size());
+			for (auto &large : heap.large){
+				put(os, large.first);
+				put(os, large.second);
+			}
+			put(os, heap.largeFree.size());
+			for (auto &large : heap.largeFree){
+				put(os, large.first);
+				put(os, large.second);
+			}
+			put(os, heap.sites.size());
+			for (int64_t count : heap.sites)
+				put(os, count);
+			put(os, heap.allocs);
+			put(os, heap.frees);
+			put(os, heap.liveBlocks);
+			put(os, heap.liveBytes);
+			put(os, heap.peakBytes);
+			os << stackImage << heapImage;
+			if (os.has_error()){
+				os.clear_error();
+				llvm::sys::fs::remove(tmp);
+				return false;
+			}
+		}
+		if (llvm::sys::fs::rename(tmp, path)){
+			llvm::sys::fs::remove(tmp);
+			return false;
+		}
+		return true;
+	}
+
+	/// Maps the file rather than reading it, so only what is used gets paged in
+	bool load(const std::string &path, std::string &error){
+		auto buf = llvm::MemoryBuffer::getFile(path, false, false);
+		if (!buf){
+			error = "can't read snapshot " + path + ": " + buf.getError().message();
+			return false;
+		}
+		data = std::move(*buf);
+		Reader in(data->getBuffer());
+		if (in.get() != Magic || in.get() != Version){
+			error = path + " is not a snapshot this interpreter wrote";
+			return false;
+		}
+		key = in.str();
+		base = in.get();
+		stackBytes = in.get();
+		heapBytes = in.get();
+		globals.resize(in.count(1));
+		for (int64_t &g : globals)
+			g = in.get();
+		frames.resize(in.count(4));
+		for (Frame &frame : frames){
+			frame.fn = in.get();
+			frame.pc = in.get();
+			frame.regs = in.get();
+			frame.dst = in.get();
+		}
+		stack.bytesUsed = in.get();
+		stack.depth = in.get();
+		stack.peakDepth = in.get();
+		stack.peakBytes = in.get();
+		heap.bytesUsed = in.get();
+		heap.free.resize(in.count(1));
+		for (int64_t &head : heap.free)
+			head = in.get();
+		heap.large.resize(in.count(2));
+		for (auto &large : heap.large){
+			large.first = in.get();
+			large.second = in.get();
+		}
+		heap.largeFree.resize(in.count(2));
+		for (auto &large : heap.largeFree){
+			large.first = in.get();
+			large.second = in.get();
+		}
+		heap.sites.resize(in.count(1));
+		for (int64_t &count : heap.sites)
+			count = in.get();
+		heap.allocs = in.get();
+		heap.frees = in.get();
+		heap.liveBlocks = in.get();
+		heap.liveBytes = in.get();
+		heap.peakBytes = in.get();
+		stackImage = in.bytes(stack.bytesUsed);
+		heapImage = in.bytes(heap.bytesUsed);
+		if (!in.done() || frames.empty()){
+			error = "snapshot " + path + " is truncated or corrupt";
+			return false;
+		}
+		return true;
+	}
+
+private:
+	/// Bump whenever the format or the bytecode changes
+	static const uint32_t Version = 4;
+	static const uint32_t Magic = 0x50534e53; // "SNSP"
+
+	static void put(llvm::raw_ostream &os, int64_t val){
+		os.write((const char *)&val, sizeof(val));
+	}
+	static void put(llvm::raw_ostream &os, const std::string &str){
+		put(os, (int64_t)str.size());
+		os << str;
+	}
+
+	class Reader{
+		llvm::StringRef mData;
+		bool mOk;
+
+	public:
+		explicit Reader(llvm::StringRef data) : mData(data), mOk(true){
+		}
+		int64_t get(){
+			int64_t val = 0;
+			if (mData.size() < sizeof(val)){
+				fail();
+				return 0;
+			}
+			memcpy(&val, mData.data(), sizeof(val));
+			mData = mData.drop_front(sizeof(val));
+			return val;
+		}
+		/// A count of elements taking words 8-byte words each, bounded by the data left
+		size_t count(size_t words){
+			int64_t n = get();
+			if (n < 0 || (uint64_t)n > mData.size() / (words * sizeof(int64_t))){
+				fail();
+				return 0;
+			}
+			return n;
+		}
+		std::string str(){
+			return bytes(get()).str();
+		}
+		llvm::StringRef bytes(uint64_t n){
+			if (n > mData.size()){
+				fail();
+				return llvm::StringRef();
+			}
+			llvm::StringRef data = mData.take_front(n);
+			mData = mData.drop_front(n);
+			return data;
+		}
+		bool done(){
+			return mOk && mData.empty();
+		}
+
+	private:
+		void fail(){
+			mOk = false;
+			mData = llvm::StringRef();
+		}
+	};
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+
+/// How guest memory holds one element: its width and, for loads, whether
+/// it is sign- or zero-extended to 64 bits. Pointers and anything else
+/// that isn't a narrower integer are EK_I64. SlotMap::elemKind maps a
+/// type to its kind once per access site; the engines then run the
+/// kernel specialised for it.
+enum ElemKind : int32_t{
+	EK_I8,
+	EK_U8,
+	EK_I16,
+	EK_U16,
+	EK_I32,
+	EK_U32,
+	EK_I64
+};
+
+inline int64_t elemBytes(ElemKind kind){
+	static const int64_t bytes[] = {1, 1, 2, 2, 4, 4, 8};
+	return bytes[kind];
+}
+
+template <typename T>
+inline int64_t loadElem(int64_t base, int64_t index){
+	return ((const T *)base)[index];
+}
+
+template <typename T>
+inline void storeElem(int64_t base, int64_t index, int64_t val){
+	((T *)base)[index] = (T)val;
+}
+
+/// For callers that only know the kind at run time
+inline int64_t loadElem(ElemKind kind, int64_t base, int64_t index){
+	switch (kind){
+	case EK_I8: return loadElem<int8_t>(base, index);
+	case EK_U8: return loadElem<uint8_t>(base, index);
+	case EK_I16: return loadElem<int16_t>(base, index);
+	case EK_U16: return loadElem<uint16_t>(base, index);
+	case EK_I32: return loadElem<int32_t>(base, index);
+	case EK_U32: return loadElem<uint32_t>(base, index);
+	default: return loadElem<int64_t>(base, index);
+	}
+}
+
+/// Stores truncate, so signedness doesn't matter
+inline void storeElem(ElemKind kind, int64_t base, int64_t index, int64_t val){
+	switch (elemBytes(kind)){
+	case 1: storeElem<int8_t>(base, index, val); break;
+	case 2: storeElem<int16_t>(base, index, val); break;
+	case 4: storeElem<int32_t>(base, index, val); break;
+	default: storeElem<int64_t>(base, index, val); break;
+	}
+}
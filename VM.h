@@ -0,0 +1,595 @@
+#pragma once
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include "Bytecode.h"
+#include "ExecStats.h"
+#include "GuestExit.h"
+#include "GuestHeap.h"
+#include "GuestIO.h"
+#include "GuestMemory.h"
+#include "GuestStack.h"
+#include "GuestThreads.h"
+#include "Jit.h"
+#include "MemoTable.h"
+#include "Profiler.h"
+#include "Snapshot.h"
+
+/// Executes a BCProgram. Guest calls push a Frame and continue in the same
+/// dispatch loop, so they don't nest host frames. With a Jit, calls to
+/// functions it has compiled run native code instead. A VM can also carry
+/// on from a Snapshot an earlier run's SNAPSHOT() call took. Threads SPAWN
+/// starts run the same loop over a Thread of their own.
+class VM{
+	/// Where to resume the caller of a call in progress. Frames stay out of
+	/// GuestMemory; the callee's registers and arrays are its GuestStack slice.
+	struct Frame{
+		const BCFunction *fn;
+		const Insn *pc;
+		int64_t *regs;
+		int32_t dst;
+	};
+	/// A memoizable call in progress, and the arguments its result is filed under
+	struct PendingMemo{
+		/// Frames below the call's
+		size_t depth;
+		int32_t fn;
+		int64_t args[MemoTable::MaxArgs];
+	};
+	/// A guest thread's part of the VM: main's, or one SPAWN started
+	struct Thread{
+		GuestStack stack;
+		std::vector<Frame> frames;
+		std::vector<PendingMemo> pending;
+		/// NULL unless counting for --stats
+		ThreadStats *stats;
+		Thread(GuestMemory &memory, int32_t slot) : stack(memory, slot), stats(NULL){
+		}
+	};
+
+	const BCProgram &mProg;
+	std::vector<int64_t> mGlobals;
+	GuestMemory mMemory;
+	Thread mMain;
+	GuestHeap mHeap;
+	GuestIO &mIO;
+	std::unique_ptr<Jit> mJit;
+	/// Where SNAPSHOT() writes, and the program's key; it does nothing without a path
+	std::string mSnapshotPath;
+	std::string mSnapshotKey;
+	/// Where run() resumes a restored snapshot; fn is NULL otherwise
+	Frame mResume;
+	/// NULL unless counting for --stats
+	ExecStats *mStats;
+	/// Last, so the threads are joined before anything they use goes away
+	GuestThreads mThreads;
+
+public:
+	/// With from, the VM's memory, frames and globals are the snapshot's,
+	/// and run() carries on where it was taken
+	VM(const BCProgram &prog, GuestIO &io, size_t stackBytes = GuestStack::DefaultReserve, const Snapshot *from = NULL)
+	    : mProg(prog), mGlobals(prog.numGlobals, 0),
+	      mMemory(from ? from->stackBytes : stackBytes, from ? from->heapBytes : GuestMemory::HeapReserve, from ? (char *)from->base : NULL,
+	              spawns(prog) ? GuestMemory::MaxThreads : 0),
+	      mMain(mMemory, 0), mHeap(mMemory), mIO(io), mResume{NULL, NULL, NULL, 0}, mStats(NULL), mThreads(mMemory, 0){
+		for (const std::string &site : prog.allocSites)
+			mHeap.addSite(site);
+		if (from)
+			restore(*from);
+	}
+
+	void setSnapshot(const std::string &path, const std::string &key){
+		mSnapshotPath = path;
+		mSnapshotKey = key;
+	}
+
+	/// Counts what each thread executes, by opcode, and what it calls.
+	/// Locals live in registers, so variable reads and writes are those of
+	/// globals.
+	void setStats(ExecStats *stats){
+		std::vector<std::string> opcodes, functions;
+		for (int op = 0; op < OP_NUM_OPCODES; op++)
+			opcodes.push_back(opcodeName((Opcode)op));
+		for (const BCFunction &f : mProg.functions)
+			functions.push_back(f.name);
+		stats->setEngine("vm", std::move(opcodes), std::move(functions));
+		mStats = stats;
+		mMain.stats = stats->addThread();
+	}
+
+	const GuestStack &getStack(){
+		return mMain.stack;
+	}
+	const GuestHeap &getHeap(){
+		return mHeap;
+	}
+	const Jit *getJit(){
+		return mJit.get();
+	}
+
+	/// Compiles functions once they've been called threshold times. Native
+	/// calls nest host frames, so hostLimit (see HostStack) bounds them.
+	void enableJit(int64_t threshold, const char *hostLimit){
+		Jit::Hooks hooks = {this, &hookGet, &hookPrint, &hookMalloc, &hookFree, &hookVecLoop, &hookCall,
+		                    &hookPushArrays, &hookPopArrays, &hookZero, &hookDivZero, &hookOverflow, &GuestMemory::fault};
+		mJit.reset(new Jit(mProg, mGlobals.data(), mMemory, hooks, threshold, hostLimit));
+	}
+
+	/// Profiling, memoization and counting run separately instantiated
+	/// loops, so they cost nothing when off. Only loops that neither
+	/// profile nor memoize enter the Jit, whose native code isn't counted.
+	int64_t run(Profiler *profiler = NULL, MemoTable *memo = NULL){
+		if (profiler){
+			for (const BCFunction &f : mProg.functions)
+				profiler->addFunction(f.name);
+			profiler->enter(mProg.entry);
+		}
+		/// Memo ids are function indices
+		if (memo)
+			for (const BCFunction &f : mProg.functions)
+				memo->addFunction(f.name);
+		if (profiler)
+			return memo ? start<true, true>(profiler, memo) : start<true, false>(profiler, NULL);
+		return memo ? start<false, true>(NULL, memo) : start<false, false>(NULL, NULL);
+	}
+
+private:
+	template <bool Profile, bool Memo>
+	int64_t start(Profiler *profiler, MemoTable *memo){
+		int64_t val;
+		if (mResume.fn)
+			val = mStats ? interpret<Profile, Memo, true>(profiler, memo, mMain, mResume.fn, mResume.pc, mResume.regs)
+			             : interpret<Profile, Memo, false>(profiler, memo, mMain, mResume.fn, mResume.pc, mResume.regs);
+		else
+			val = mStats ? execute<Profile, Memo, true>(profiler, memo, mMain, mProg.entry, NULL)
+			             : execute<Profile, Memo, false>(profiler, memo, mMain, mProg.entry, NULL);
+		/// The program is over once its threads are
+		mThreads.joinAll();
+		return val;
+	}
+
+	/// Runs function entry on args in thread T until it returns
+	template <bool Profile, bool Memo, bool Count>
+	int64_t execute(Profiler *profiler, MemoTable *memo, Thread &T, int32_t entry, const int64_t *args){
+		const BCFunction *fn = &mProg.functions[entry];
+		/// Returning to the bottom frame leaves the loop
+		T.frames.push_back(Frame{NULL, NULL, NULL, 0});
+		int64_t *R = pushRegs(T, fn);
+		if (Count)
+			T.stats->pushFrame();
+		for (int32_t i = 0; i < fn->numParams; i++)
+			R[i] = args[i];
+		return interpret<Profile, Memo, Count>(profiler, memo, T, fn, fn->code.data(), R);
+	}
+
+	/// The dispatch loop, from pc in fn with registers R until the frame
+	/// on top of T's is returned to. Only main's thread enters the Jit.
+	template <bool Profile, bool Memo, bool Count>
+	int64_t interpret(Profiler *profiler, MemoTable *memo, Thread &T, const BCFunction *fn, const Insn *pc, int64_t *R){
+		const int64_t *K = mProg.constants.data();
+		int64_t *G = mGlobals.data();
+		for (;;){
+			if (Profile && fn->lines[pc - fn->code.data()])
+				profiler->line(fn->lines[pc - fn->code.data()]);
+			const Insn &I = *pc++;
+			if (Count)
+				T.stats->nodes[I.op].add();
+			switch (I.op){
+			case OP_MOV:
+				R[I.a] = R[I.b];
+				break;
+			case OP_LOADI:
+				R[I.a] = I.b;
+				break;
+			case OP_LOADK:
+				R[I.a] = K[I.b];
+				break;
+			case OP_GETG:
+				if (Count)
+					T.stats->varReads.add();
+				R[I.a] = G[I.b];
+				break;
+			case OP_SETG:
+				if (Count)
+					T.stats->varWrites.add();
+				G[I.a] = R[I.b];
+				break;
+			case OP_ADD:
+				R[I.a] = R[I.b] + R[I.c];
+				break;
+			case OP_ADDI:
+				R[I.a] = R[I.b] + I.c;
+				break;
+			case OP_SUB:
+				R[I.a] = R[I.b] - R[I.c];
+				break;
+			case OP_MUL:
+				R[I.a] = R[I.b] * R[I.c];
+				break;
+			case OP_MULI:
+				R[I.a] = R[I.b] * I.c;
+				break;
+			case OP_DIV:
+				if (R[I.c] == 0){
+					guestError("can't div 0 ");
+				}
+				/// INT64_MIN / -1 wraps, as + - * do, instead of trapping
+				R[I.a] = R[I.c] == -1 ? (int64_t)(0 - (uint64_t)R[I.b]) : R[I.b] / R[I.c];
+				break;
+			case OP_LT:
+				R[I.a] = R[I.b] < R[I.c];
+				break;
+			case OP_GT:
+				R[I.a] = R[I.b] > R[I.c];
+				break;
+			case OP_EQ:
+				R[I.a] = R[I.b] == R[I.c];
+				break;
+			case OP_LE:
+				R[I.a] = R[I.b] <= R[I.c];
+				break;
+			case OP_GE:
+				R[I.a] = R[I.b] >= R[I.c];
+				break;
+			case OP_NEG:
+				R[I.a] = -R[I.b];
+				break;
+			case OP_NOT:
+				R[I.a] = ~R[I.b];
+				break;
+			case OP_LNOT:
+				R[I.a] = !R[I.b];
+				break;
+			case OP_LDELEM_I8:
+				R[I.a] = mMemory.load<int8_t>(R[I.b], R[I.c]);
+				break;
+			case OP_LDELEM_U8:
+				R[I.a] = mMemory.load<uint8_t>(R[I.b], R[I.c]);
+				break;
+			case OP_LDELEM_I16:
+				R[I.a] = mMemory.load<int16_t>(R[I.b], R[I.c]);
+				break;
+			case OP_LDELEM_U16:
+				R[I.a] = mMemory.load<uint16_t>(R[I.b], R[I.c]);
+				break;
+			case OP_LDELEM_I32:
+				R[I.a] = mMemory.load<int32_t>(R[I.b], R[I.c]);
+				break;
+			case OP_LDELEM_U32:
+				R[I.a] = mMemory.load<uint32_t>(R[I.b], R[I.c]);
+				break;
+			case OP_LDELEM_I64:
+				R[I.a] = mMemory.load<int64_t>(R[I.b], R[I.c]);
+				break;
+			case OP_STELEM_I8:
+				mMemory.store<int8_t>(R[I.a], R[I.b], R[I.c]);
+				break;
+			case OP_STELEM_I16:
+				mMemory.store<int16_t>(R[I.a], R[I.b], R[I.c]);
+				break;
+			case OP_STELEM_I32:
+				mMemory.store<int32_t>(R[I.a], R[I.b], R[I.c]);
+				break;
+			case OP_STELEM_I64:
+				mMemory.store<int64_t>(R[I.a], R[I.b], R[I.c]);
+				break;
+			case OP_LOAD_I8:
+				R[I.a] = mMemory.load<int8_t>(R[I.b], I.c);
+				break;
+			case OP_LOAD_U8:
+				R[I.a] = mMemory.load<uint8_t>(R[I.b], I.c);
+				break;
+			case OP_LOAD_I16:
+				R[I.a] = mMemory.load<int16_t>(R[I.b], I.c);
+				break;
+			case OP_LOAD_U16:
+				R[I.a] = mMemory.load<uint16_t>(R[I.b], I.c);
+				break;
+			case OP_LOAD_I32:
+				R[I.a] = mMemory.load<int32_t>(R[I.b], I.c);
+				break;
+			case OP_LOAD_U32:
+				R[I.a] = mMemory.load<uint32_t>(R[I.b], I.c);
+				break;
+			case OP_LOAD_I64:
+				R[I.a] = mMemory.load<int64_t>(R[I.b], I.c);
+				break;
+			case OP_STORE_I8:
+				mMemory.store<int8_t>(R[I.a], I.c, R[I.b]);
+				break;
+			case OP_STORE_I16:
+				mMemory.store<int16_t>(R[I.a], I.c, R[I.b]);
+				break;
+			case OP_STORE_I32:
+				mMemory.store<int32_t>(R[I.a], I.c, R[I.b]);
+				break;
+			case OP_STORE_I64:
+				mMemory.store<int64_t>(R[I.a], I.c, R[I.b]);
+				break;
+			case OP_ALLOCA:{
+				char *array = (char *)(R + fn->numRegs) + I.b;
+				GuestStack::zero(array, I.c);
+				R[I.a] = (int64_t)array;
+				if (Count)
+					T.stats->arrayBytes.add(I.c);
+				break;
+			}
+			case OP_JMP:
+				pc = fn->code.data() + I.a;
+				break;
+			case OP_JZ:
+				if (!R[I.a])
+					pc = fn->code.data() + I.b;
+				break;
+			case OP_JNZ:
+				if (R[I.a])
+					pc = fn->code.data() + I.b;
+				break;
+			case OP_JLT:
+				if (R[I.a] < R[I.b])
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JLE:
+				if (R[I.a] <= R[I.b])
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JEQ:
+				if (R[I.a] == R[I.b])
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JNE:
+				if (R[I.a] != R[I.b])
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JLTI:
+				if (R[I.a] < I.b)
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JGTI:
+				if (R[I.a] > I.b)
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JEQI:
+				if (R[I.a] == I.b)
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_JNEI:
+				if (R[I.a] != I.b)
+					pc = fn->code.data() + I.c;
+				break;
+			case OP_VLOOP:
+				runVecLoop(mProg.vecLoops[I.a], R, R[I.b], mMemory);
+				break;
+			case OP_CALL:{
+				const BCFunction *callee = &mProg.functions[I.b];
+				int64_t *args = R + I.c;
+				if (Count)
+					T.stats->calls[I.b].add();
+				if (!Profile && !Memo && mJit && &T == &mMain)
+					if (Jit::NativeFn native = mJit->enter(I.b)){
+						R[I.a] = native(args);
+						break;
+					}
+				bool memoize = Memo && callee->pure && MemoTable::fits(callee->numParams);
+				if (memoize && memo->lookup(I.b, args, callee->numParams, R[I.a]))
+					break;
+				if (Profile)
+					profiler->enter(I.b);
+				T.frames.push_back(Frame{fn, pc, R, I.a});
+				if (memoize){
+					T.pending.push_back(PendingMemo{T.frames.size(), I.b, {}});
+					for (int32_t i = 0; i < callee->numParams; i++)
+						T.pending.back().args[i] = args[i];
+				}
+				R = pushRegs(T, callee);
+				if (Count)
+					T.stats->pushFrame();
+				for (int32_t i = 0; i < callee->numParams; i++)
+					R[i] = args[i];
+				fn = callee;
+				pc = fn->code.data();
+				break;
+			}
+			case OP_RET:{
+				int64_t val = R[I.a];
+				T.stack.popFrame(R);
+				if (Count)
+					T.stats->popFrame();
+				if (Profile)
+					profiler->leave();
+				if (Memo && !T.pending.empty() && T.pending.back().depth == T.frames.size()){
+					const PendingMemo &pending = T.pending.back();
+					memo->store(pending.fn, pending.args, mProg.functions[pending.fn].numParams, val);
+					T.pending.pop_back();
+				}
+				Frame frame = T.frames.back();
+				T.frames.pop_back();
+				if (!frame.fn)
+					return val;
+				fn = frame.fn;
+				pc = frame.pc;
+				R = frame.regs;
+				R[frame.dst] = val;
+				break;
+			}
+			case OP_GET:
+				R[I.a] = mIO.get();
+				break;
+			case OP_PRINT:
+				mIO.print(R[I.a]);
+				break;
+			case OP_MALLOC:
+				R[I.a] = (int64_t)mHeap.allocate(R[I.b], I.c);
+				if (Count)
+					T.stats->mallocBytes.add(R[I.b]);
+				break;
+			case OP_FREE:
+				mHeap.release((void *)R[I.a]);
+				break;
+			case OP_SNAPSHOT:
+				if (!mSnapshotPath.empty())
+					snapshot(T, fn, pc, R);
+				break;
+			case OP_SPAWN:
+				R[I.a] = spawn(I.b, R[I.c]);
+				break;
+			case OP_JOIN:
+				R[I.a] = mThreads.join(R[I.b]);
+				break;
+			case OP_XADD_I32:
+				R[I.a] = mMemory.fetchAdd<int32_t>(R[I.b], R[I.c]);
+				break;
+			case OP_XADD_I64:
+				R[I.a] = mMemory.fetchAdd<int64_t>(R[I.b], R[I.c]);
+				break;
+			case OP_CAS_I32:
+				R[I.a] = mMemory.compareExchange<int32_t>(R[I.b], R[I.c], R[I.c + 1]);
+				break;
+			case OP_CAS_I64:
+				R[I.a] = mMemory.compareExchange<int64_t>(R[I.b], R[I.c], R[I.c + 1]);
+				break;
+			default:
+				guestError("bad opcode " + std::to_string((int)I.op));
+			}
+		}
+	}
+
+	/// Only a program that can SPAWN gets thread stacks reserved
+	static bool spawns(const BCProgram &prog){
+		for (const BCFunction &f : prog.functions)
+			for (const Insn &I : f.code)
+				if (I.op == OP_SPAWN)
+					return true;
+		return false;
+	}
+
+	/// SPAWN: fn runs on arg in a thread of its own, interpreted and
+	/// neither profiled nor memoized. From here on the heap and IO are
+	/// shared, so they start locking.
+	int64_t spawn(int32_t fn, int64_t arg){
+		int32_t slot = mThreads.claim();
+		mHeap.share();
+		mIO.share();
+		return mThreads.start(slot, [this, slot, fn, arg](const char *){
+			Thread thread(mMemory, slot);
+			if (!mStats)
+				return execute<false, false, false>(NULL, NULL, thread, fn, &arg);
+			thread.stats = mStats->addThread();
+			thread.stats->calls[fn].add();
+			int64_t val = execute<false, false, true>(NULL, NULL, thread, fn, &arg);
+			mStats->retire(thread.stats);
+			return val;
+		});
+	}
+
+	/// Writes everything but the host side of native calls, which a
+	/// snapshot can't hold, and other threads, which it doesn't either
+	void snapshot(Thread &T, const BCFunction *fn, const Insn *pc, int64_t *R){
+		if (&T != &mMain || mThreads.running())
+			guestError("SNAPSHOT() can't be taken while guest threads run");
+		Snapshot snap;
+		snap.key = mSnapshotKey;
+		snap.base = (uint64_t)mMemory.base();
+		snap.stackBytes = mMemory.stackBytes();
+		snap.heapBytes = mMemory.heapBytes();
+		snap.globals = mGlobals;
+		for (size_t i = 0; i < mMain.frames.size(); i++){
+			const Frame &frame = mMain.frames[i];
+			if (!frame.fn && i)
+				guestError("SNAPSHOT() can't be taken under a native call; run without --jit");
+			snap.frames.push_back(Snapshot::Frame{frame.fn ? frame.fn - mProg.functions.data() : -1,
+			                                      frame.fn ? frame.pc - frame.fn->code.data() : 0, (int64_t)frame.regs, frame.dst});
+		}
+		snap.frames.push_back(Snapshot::Frame{fn - mProg.functions.data(), pc - fn->code.data(), (int64_t)R, 0});
+		snap.stack = mMain.stack.state();
+		snap.heap = mHeap.state();
+		snap.stackImage = llvm::StringRef(mMemory.stackBase(), snap.stack.bytesUsed);
+		snap.heapImage = llvm::StringRef(mMemory.heapBase(), snap.heap.bytesUsed);
+		if (!snap.write(mSnapshotPath))
+			guestError("can't write snapshot " + mSnapshotPath);
+	}
+
+	/// Takes over a snapshot's state, checking that whatever it points at
+	/// is somewhere this program and GuestMemory have it
+	void restore(const Snapshot &snap){
+		if (snap.globals.size() != mGlobals.size() || snap.stackImage.size() != snap.stack.bytesUsed || snap.heapImage.size() != snap.heap.bytesUsed ||
+		    !mMain.stack.restore(snap.stack))
+			misfit();
+		memcpy(mMemory.stackBase(), snap.stackImage.data(), snap.stackImage.size());
+		memcpy(mMemory.heapBase(), snap.heapImage.data(), snap.heapImage.size());
+		if (!mHeap.restore(snap.heap))
+			misfit();
+		mGlobals = snap.globals;
+		for (size_t i = 0; i < snap.frames.size(); i++){
+			const Snapshot::Frame &saved = snap.frames[i];
+			Frame frame{NULL, NULL, NULL, 0};
+			if (i){
+				if (saved.fn < 0 || saved.fn >= (int64_t)mProg.functions.size())
+					misfit();
+				frame.fn = &mProg.functions[saved.fn];
+				if (saved.pc < 0 || saved.pc >= (int64_t)frame.fn->code.size() || saved.dst < 0 || saved.dst >= frame.fn->numRegs ||
+				    !mMemory.contains(saved.regs, frame.fn->numRegs * sizeof(int64_t) + frame.fn->arrayBytes) ||
+				    (uint64_t)(saved.regs - (int64_t)mMemory.stackBase()) > snap.stack.bytesUsed)
+					misfit();
+				frame.pc = frame.fn->code.data() + saved.pc;
+				frame.regs = (int64_t *)saved.regs;
+				frame.dst = saved.dst;
+			}
+			else if (saved.fn != -1)
+				misfit();
+			if (i + 1 < snap.frames.size())
+				mMain.frames.push_back(frame);
+			else
+				mResume = frame;
+		}
+		if (!mResume.fn)
+			misfit();
+	}
+
+	[[noreturn]] static void misfit(){
+		guestError("snapshot doesn't fit this program");
+	}
+
+	/// A GuestStack slice for fn's registers followed by its arrays
+	int64_t *pushRegs(Thread &T, const BCFunction *fn){
+		return (int64_t *)T.stack.pushFrame(fn->numRegs * sizeof(int64_t) + fn->arrayBytes);
+	}
+
+	/// What native code calls back into; env is the VM
+	static int64_t hookGet(void *env){
+		return ((VM *)env)->mIO.get();
+	}
+	static void hookPrint(void *env, int64_t val){
+		((VM *)env)->mIO.print(val);
+	}
+	static int64_t hookMalloc(void *env, int64_t bytes, int64_t site){
+		return (int64_t)((VM *)env)->mHeap.allocate(bytes, site);
+	}
+	static void hookFree(void *env, int64_t ptr){
+		((VM *)env)->mHeap.release((void *)ptr);
+	}
+	static void hookVecLoop(void *env, int64_t loop, int64_t *regs, int64_t bound){
+		runVecLoop(((VM *)env)->mProg.vecLoops[loop], regs, bound, ((VM *)env)->mMemory);
+	}
+	static int64_t hookCall(void *env, int64_t fn, const int64_t *args){
+		VM *vm = (VM *)env;
+		if (Jit::NativeFn native = vm->mJit->enter(fn))
+			return native(args);
+		return vm->execute<false, false, false>(NULL, NULL, vm->mMain, fn, args);
+	}
+	static char *hookPushArrays(void *env, int64_t bytes){
+		return (char *)((VM *)env)->mMain.stack.pushFrame(bytes);
+	}
+	static void hookPopArrays(void *env, char *arrays){
+		((VM *)env)->mMain.stack.popFrame(arrays);
+	}
+	static void hookZero(char *mem, int64_t bytes){
+		GuestStack::zero(mem, bytes);
+	}
+	static void hookDivZero(void *){
+		guestError("can't div 0 ");
+	}
+	static void hookOverflow(void *env){
+		guestError("guest stack overflow in native code (limit " + std::to_string(((VM *)env)->mMain.stack.reserved()) + " bytes)");
+	}
+};
@@ -0,0 +1,301 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "GuestMemory.h"
+#include "TypedAccess.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VEC_X86 1
+#endif
+
+/// One step of a vector loop's body, in postfix order. Operands name
+/// frame slots (registers, on the VM): scalars read their value, loads
+/// the base address of an array indexed by the loop variable.
+enum VecOpKind : int32_t{
+	VEC_INDEX,   // i
+	VEC_CONST,   // value
+	VEC_SCALAR,  // slots[operand]
+	VEC_LOAD,    // ((kind *)slots[operand])[i]
+	VEC_ADD,
+	VEC_SUB,
+	VEC_MUL,
+	VEC_NEG
+};
+
+struct VecOp{
+	VecOpKind op;
+	ElemKind kind;
+	int32_t operand;
+	int64_t value;
+};
+
+/// for (; slots[index] < bound (or <=); slots[index] = slots[index] + 1)
+///     ((dst *)slots[array])[slots[index]] = ops;
+/// over int or char arrays, as found by VectorLoops. Every element only
+/// depends on its own index, and stores keep at most 32 bits of a sum,
+/// difference or product, which only the low 32 bits of its operands
+/// decide; so the body runs on 32-bit lanes, a chunk of elements at a time.
+struct VecLoop{
+	ElemKind dst;
+	int32_t array;
+	int32_t index;
+	bool inclusive;
+	std::vector<VecOp> ops;
+};
+
+namespace vec{
+
+static const int64_t Chunk = 256;
+/// Deepest evaluation stack a body may need
+static const int32_t MaxDepth = 6;
+
+typedef int32_t Lanes[Chunk];
+
+/// The building blocks of a chunk, one set per instruction set. Loads and
+/// stores touch exactly n elements; arithmetic may run past n to the
+/// next multiple of 8, since every Lanes holds Chunk.
+struct Kernels{
+	const char *name;
+	void (*iota)(int32_t *out, int64_t first, int64_t n);
+	void (*fill)(int32_t *out, int32_t val, int64_t n);
+	void (*load)(int32_t *out, const char *base, ElemKind kind, int64_t first, int64_t n);
+	void (*store)(char *base, ElemKind kind, int64_t first, const int32_t *in, int64_t n);
+	void (*add)(int32_t *acc, const int32_t *in, int64_t n);
+	void (*sub)(int32_t *acc, const int32_t *in, int64_t n);
+	void (*mul)(int32_t *acc, const int32_t *in, int64_t n);
+	void (*neg)(int32_t *acc, int64_t n);
+};
+
+/// Portable fallback; also finishes the tails the vector versions leave
+struct Scalar{
+	static void iota(int32_t *out, int64_t first, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			out[k] = (int32_t)(first + k);
+	}
+	static void fill(int32_t *out, int32_t val, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			out[k] = val;
+	}
+	static void load(int32_t *out, const char *base, ElemKind kind, int64_t first, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			out[k] = (int32_t)loadElem(kind, (int64_t)base, first + k);
+	}
+	static void store(char *base, ElemKind kind, int64_t first, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			storeElem(kind, (int64_t)base, first + k, in[k]);
+	}
+	/// Wrapping 32-bit arithmetic, done unsigned to keep it defined
+	static void add(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			acc[k] = (int32_t)((uint32_t)acc[k] + (uint32_t)in[k]);
+	}
+	static void sub(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			acc[k] = (int32_t)((uint32_t)acc[k] - (uint32_t)in[k]);
+	}
+	static void mul(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			acc[k] = (int32_t)((uint32_t)acc[k] * (uint32_t)in[k]);
+	}
+	static void neg(int32_t *acc, int64_t n){
+		for (int64_t k = 0; k < n; k++)
+			acc[k] = (int32_t)(0u - (uint32_t)acc[k]);
+	}
+};
+
+#ifdef VEC_X86
+#define VEC_SSE __attribute__((target("sse4.1")))
+#define VEC_AVX2 __attribute__((target("avx2")))
+
+struct SSE41{
+	VEC_SSE static void iota(int32_t *out, int64_t first, int64_t n){
+		__m128i v = _mm_add_epi32(_mm_set1_epi32((int32_t)first), _mm_setr_epi32(0, 1, 2, 3));
+		for (int64_t k = 0; k < n; k += 4){
+			_mm_store_si128((__m128i *)(out + k), v);
+			v = _mm_add_epi32(v, _mm_set1_epi32(4));
+		}
+	}
+	VEC_SSE static void fill(int32_t *out, int32_t val, int64_t n){
+		__m128i v = _mm_set1_epi32(val);
+		for (int64_t k = 0; k < n; k += 4)
+			_mm_store_si128((__m128i *)(out + k), v);
+	}
+	VEC_SSE static void load(int32_t *out, const char *base, ElemKind kind, int64_t first, int64_t n){
+		int64_t k = 0;
+		if (kind == EK_I32 || kind == EK_U32){
+			const int32_t *src = (const int32_t *)base + first;
+			for (; k + 4 <= n; k += 4)
+				_mm_store_si128((__m128i *)(out + k), _mm_loadu_si128((const __m128i *)(src + k)));
+		}
+		else if (kind == EK_I8 || kind == EK_U8){
+			const char *src = base + first;
+			for (; k + 4 <= n; k += 4){
+				int32_t bytes;
+				memcpy(&bytes, src + k, 4);
+				__m128i v = _mm_cvtsi32_si128(bytes);
+				_mm_store_si128((__m128i *)(out + k), kind == EK_I8 ? _mm_cvtepi8_epi32(v) : _mm_cvtepu8_epi32(v));
+			}
+		}
+		Scalar::load(out + k, base, kind, first + k, n - k);
+	}
+	VEC_SSE static void store(char *base, ElemKind kind, int64_t first, const int32_t *in, int64_t n){
+		int64_t k = 0;
+		if (kind == EK_I32 || kind == EK_U32){
+			int32_t *dst = (int32_t *)base + first;
+			for (; k + 4 <= n; k += 4)
+				_mm_storeu_si128((__m128i *)(dst + k), _mm_load_si128((const __m128i *)(in + k)));
+		}
+		else if (kind == EK_I8 || kind == EK_U8){
+			/// Low byte of each lane
+			const __m128i pick = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+			char *dst = base + first;
+			for (; k + 4 <= n; k += 4){
+				int32_t bytes = _mm_cvtsi128_si32(_mm_shuffle_epi8(_mm_load_si128((const __m128i *)(in + k)), pick));
+				memcpy(dst + k, &bytes, 4);
+			}
+		}
+		Scalar::store(base, kind, first + k, in + k, n - k);
+	}
+	VEC_SSE static void add(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k += 4)
+			_mm_store_si128((__m128i *)(acc + k), _mm_add_epi32(_mm_load_si128((__m128i *)(acc + k)), _mm_load_si128((const __m128i *)(in + k))));
+	}
+	VEC_SSE static void sub(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k += 4)
+			_mm_store_si128((__m128i *)(acc + k), _mm_sub_epi32(_mm_load_si128((__m128i *)(acc + k)), _mm_load_si128((const __m128i *)(in + k))));
+	}
+	VEC_SSE static void mul(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k += 4)
+			_mm_store_si128((__m128i *)(acc + k), _mm_mullo_epi32(_mm_load_si128((__m128i *)(acc + k)), _mm_load_si128((const __m128i *)(in + k))));
+	}
+	VEC_SSE static void neg(int32_t *acc, int64_t n){
+		for (int64_t k = 0; k < n; k += 4)
+			_mm_store_si128((__m128i *)(acc + k), _mm_sub_epi32(_mm_setzero_si128(), _mm_load_si128((__m128i *)(acc + k))));
+	}
+};
+
+struct AVX2{
+	VEC_AVX2 static void iota(int32_t *out, int64_t first, int64_t n){
+		__m256i v = _mm256_add_epi32(_mm256_set1_epi32((int32_t)first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		for (int64_t k = 0; k < n; k += 8){
+			_mm256_store_si256((__m256i *)(out + k), v);
+			v = _mm256_add_epi32(v, _mm256_set1_epi32(8));
+		}
+	}
+	VEC_AVX2 static void fill(int32_t *out, int32_t val, int64_t n){
+		__m256i v = _mm256_set1_epi32(val);
+		for (int64_t k = 0; k < n; k += 8)
+			_mm256_store_si256((__m256i *)(out + k), v);
+	}
+	VEC_AVX2 static void load(int32_t *out, const char *base, ElemKind kind, int64_t first, int64_t n){
+		int64_t k = 0;
+		if (kind == EK_I32 || kind == EK_U32){
+			const int32_t *src = (const int32_t *)base + first;
+			for (; k + 8 <= n; k += 8)
+				_mm256_store_si256((__m256i *)(out + k), _mm256_loadu_si256((const __m256i *)(src + k)));
+		}
+		else if (kind == EK_I8 || kind == EK_U8){
+			const char *src = base + first;
+			for (; k + 8 <= n; k += 8){
+				__m128i v = _mm_loadl_epi64((const __m128i *)(src + k));
+				_mm256_store_si256((__m256i *)(out + k), kind == EK_I8 ? _mm256_cvtepi8_epi32(v) : _mm256_cvtepu8_epi32(v));
+			}
+		}
+		Scalar::load(out + k, base, kind, first + k, n - k);
+	}
+	VEC_AVX2 static void store(char *base, ElemKind kind, int64_t first, const int32_t *in, int64_t n){
+		int64_t k = 0;
+		if (kind == EK_I32 || kind == EK_U32){
+			int32_t *dst = (int32_t *)base + first;
+			for (; k + 8 <= n; k += 8)
+				_mm256_storeu_si256((__m256i *)(dst + k), _mm256_load_si256((const __m256i *)(in + k)));
+		}
+		else if (kind == EK_I8 || kind == EK_U8){
+			/// Low byte of each lane, gathered into the bottom 4 bytes of each half
+			const __m256i pick = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			                                      0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+			char *dst = base + first;
+			for (; k + 8 <= n; k += 8){
+				__m256i bytes = _mm256_shuffle_epi8(_mm256_load_si256((const __m256i *)(in + k)), pick);
+				__m128i packed = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1)));
+				_mm_storel_epi64((__m128i *)(dst + k), packed);
+			}
+		}
+		Scalar::store(base, kind, first + k, in + k, n - k);
+	}
+	VEC_AVX2 static void add(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k += 8)
+			_mm256_store_si256((__m256i *)(acc + k), _mm256_add_epi32(_mm256_load_si256((__m256i *)(acc + k)), _mm256_load_si256((const __m256i *)(in + k))));
+	}
+	VEC_AVX2 static void sub(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k += 8)
+			_mm256_store_si256((__m256i *)(acc + k), _mm256_sub_epi32(_mm256_load_si256((__m256i *)(acc + k)), _mm256_load_si256((const __m256i *)(in + k))));
+	}
+	VEC_AVX2 static void mul(int32_t *acc, const int32_t *in, int64_t n){
+		for (int64_t k = 0; k < n; k += 8)
+			_mm256_store_si256((__m256i *)(acc + k), _mm256_mullo_epi32(_mm256_load_si256((__m256i *)(acc + k)), _mm256_load_si256((const __m256i *)(in + k))));
+	}
+	VEC_AVX2 static void neg(int32_t *acc, int64_t n){
+		for (int64_t k = 0; k < n; k += 8)
+			_mm256_store_si256((__m256i *)(acc + k), _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_load_si256((__m256i *)(acc + k))));
+	}
+};
+#endif
+
+template <typename K>
+inline Kernels kernels(const char *name){
+	return Kernels{name, &K::iota, &K::fill, &K::load, &K::store, &K::add, &K::sub, &K::mul, &K::neg};
+}
+
+/// The widest set this CPU runs, picked once
+inline const Kernels &best(){
+	static const Kernels chosen = [](){
+#ifdef VEC_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return kernels<AVX2>("avx2");
+		if (__builtin_cpu_supports("sse4.1"))
+			return kernels<SSE41>("sse4.1");
+#endif
+		return kernels<Scalar>("scalar");
+	}();
+	return chosen;
+}
+
+}
+
+/// Runs loop in the frame whose slots are given, up to bound, and leaves
+/// the loop variable where the loop would have. Every array it touches is
+/// checked against memory once, for the whole range, before it starts.
+inline void runVecLoop(const VecLoop &loop, int64_t *slots, int64_t bound, const GuestMemory &memory){
+	int64_t begin = slots[loop.index];
+	int64_t end = loop.inclusive ? bound + 1 : bound;
+	if (begin >= end)
+		return;
+	memory.checkRange(slots[loop.array], elemBytes(loop.dst), begin, end);
+	for (const VecOp &op : loop.ops)
+		if (op.op == VEC_LOAD)
+			memory.checkRange(slots[op.operand], elemBytes(op.kind), begin, end);
+	const vec::Kernels &K = vec::best();
+	alignas(32) vec::Lanes stack[vec::MaxDepth];
+	char *dst = (char *)slots[loop.array];
+	for (int64_t first = begin; first < end; first += vec::Chunk){
+		int64_t n = end - first < vec::Chunk ? end - first : vec::Chunk;
+		int32_t depth = 0;
+		for (const VecOp &op : loop.ops){
+			switch (op.op){
+			case VEC_INDEX: K.iota(stack[depth++], first, n); break;
+			case VEC_CONST: K.fill(stack[depth++], (int32_t)op.value, n); break;
+			case VEC_SCALAR: K.fill(stack[depth++], (int32_t)slots[op.operand], n); break;
+			case VEC_LOAD: K.load(stack[depth++], (const char *)slots[op.operand], op.kind, first, n); break;
+			case VEC_ADD: depth--; K.add(stack[depth - 1], stack[depth], n); break;
+			case VEC_SUB: depth--; K.sub(stack[depth - 1], stack[depth], n); break;
+			case VEC_MUL: depth--; K.mul(stack[depth - 1], stack[depth], n); break;
+			case VEC_NEG: K.neg(stack[depth - 1], n); break;
+			}
+		}
+		K.store(dst, loop.dst, first, stack[0], n);
+	}
+	slots[loop.index] = end;
+}
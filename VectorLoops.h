@@ -0,0 +1,196 @@
+#pragma once
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "SlotMap.h"
+#include "VecKernel.h"
+
+using namespace clang;
+
+/// A loop both engines may run with runVecLoop instead of statement by
+/// statement: once its init has run, the loop is the VecLoop, with bound
+/// evaluated once.
+struct VecPlan{
+	VecLoop loop;
+	Expr *bound;
+};
+
+/// Finds the for loops that fill a local int or char array element by
+/// element:
+///     for (...; i < n; i = i + 1) a[i] = <expr>;
+/// where i is a local integer, n is made of constants and locals, and
+/// <expr> combines i, constants, locals and b[i] of local int or char
+/// arrays b with +, - and *. Nothing in such a body can change i, n or a
+/// scalar it reads, and each element depends only on its own index, so
+/// the iterations are independent.
+class VectorLoops{
+	const SlotMap *mSlots;
+	llvm::DenseMap<const ForStmt *, VecPlan> mPlans;
+
+public:
+	VectorLoops() : mSlots(NULL){
+	}
+
+	void analyze(TranslationUnitDecl *unit, const SlotMap &slots){
+		mSlots = &slots;
+		for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i)
+			if (FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i))
+				if (fdecl->doesThisDeclarationHaveABody())
+					collect(fdecl->getBody());
+	}
+
+	/// NULL unless forstmt is such a loop
+	const VecPlan *lookup(const ForStmt *forstmt) const{
+		auto it = mPlans.find(forstmt);
+		return it == mPlans.end() ? NULL : &it->second;
+	}
+
+private:
+	void collect(Stmt *stmt){
+		if (ForStmt *forstmt = dyn_cast<ForStmt>(stmt)){
+			VecPlan plan;
+			if (match(forstmt, plan))
+				mPlans[forstmt] = plan;
+		}
+		for (Stmt *child : stmt->children())
+			if (child)
+				collect(child);
+	}
+
+	static Expr *strip(Expr *expr){
+		expr = expr->IgnoreImpCasts();
+		while (ParenExpr *paren = dyn_cast<ParenExpr>(expr))
+			expr = paren->getSubExpr()->IgnoreImpCasts();
+		return expr;
+	}
+
+	/// The local variable expr names, or NULL
+	const VarDecl *local(Expr *expr) const{
+		DeclRefExpr *ref = dyn_cast<DeclRefExpr>(strip(expr));
+		if (!ref)
+			return NULL;
+		const VarDecl *vardecl = dyn_cast<VarDecl>(ref->getDecl());
+		const VarSlot *slot = vardecl ? mSlots->lookup(vardecl) : NULL;
+		return slot && !slot->global ? vardecl : NULL;
+	}
+
+	const VarDecl *localScalar(Expr *expr) const{
+		const VarDecl *vardecl = local(expr);
+		return vardecl && vardecl->getType()->isIntegerType() ? vardecl : NULL;
+	}
+
+	/// A local int or char array, and its element kind
+	const VarDecl *localArray(Expr *expr, ElemKind &kind) const{
+		const VarDecl *vardecl = local(expr);
+		if (!vardecl || !isa<ConstantArrayType>(vardecl->getType().getTypePtr()))
+			return NULL;
+		kind = SlotMap::pointeeKind(strip(expr));
+		if (kind != EK_I8 && kind != EK_U8 && kind != EK_I32 && kind != EK_U32)
+			return NULL;
+		return vardecl;
+	}
+
+	int32_t slotOf(const VarDecl *vardecl) const{
+		return mSlots->lookup(vardecl)->index;
+	}
+
+	bool match(ForStmt *forstmt, VecPlan &plan) const{
+		if (!forstmt->getCond() || !forstmt->getInc() || !forstmt->getBody())
+			return false;
+		BinaryOperator *cond = dyn_cast<BinaryOperator>(strip(forstmt->getCond()));
+		if (!cond || (cond->getOpcode() != BO_LT && cond->getOpcode() != BO_LE))
+			return false;
+		const VarDecl *index = localScalar(cond->getLHS());
+		if (!index || !increments(forstmt->getInc(), index))
+			return false;
+		plan.loop.index = slotOf(index);
+		plan.loop.inclusive = cond->getOpcode() == BO_LE;
+		plan.bound = cond->getRHS();
+		std::vector<VecOp> ops;
+		int32_t depth = 0, peak = 0;
+		if (!operands(plan.bound, NULL, ops, depth, peak))
+			return false;
+
+		Stmt *body = forstmt->getBody();
+		if (CompoundStmt *compound = dyn_cast<CompoundStmt>(body)){
+			if (compound->size() != 1)
+				return false;
+			body = compound->body_front();
+		}
+		BinaryOperator *assign = dyn_cast<BinaryOperator>(body);
+		if (!assign || assign->getOpcode() != BO_Assign)
+			return false;
+		ArraySubscriptExpr *element = dyn_cast<ArraySubscriptExpr>(strip(assign->getLHS()));
+		if (!element || local(element->getIdx()) != index)
+			return false;
+		const VarDecl *array = localArray(element->getBase(), plan.loop.dst);
+		if (!array)
+			return false;
+		plan.loop.array = slotOf(array);
+		depth = peak = 0;
+		return operands(assign->getRHS(), index, plan.loop.ops, depth, peak);
+	}
+
+	/// i = i + 1 or i = 1 + i
+	bool increments(Expr *inc, const VarDecl *index) const{
+		BinaryOperator *assign = dyn_cast<BinaryOperator>(strip(inc));
+		if (!assign || assign->getOpcode() != BO_Assign || local(assign->getLHS()) != index)
+			return false;
+		BinaryOperator *add = dyn_cast<BinaryOperator>(strip(assign->getRHS()));
+		if (!add || add->getOpcode() != BO_Add)
+			return false;
+		IntegerLiteral *one = dyn_cast<IntegerLiteral>(strip(local(add->getLHS()) == index ? add->getRHS() : add->getLHS()));
+		return one && one->getValue() == 1 && (local(add->getLHS()) == index || local(add->getRHS()) == index);
+	}
+
+	/// Appends the postfix ops computing expr; with index NULL, expr may
+	/// only use constants and scalars
+	bool operands(Expr *expr, const VarDecl *index, std::vector<VecOp> &ops, int32_t &depth, int32_t &peak) const{
+		expr = strip(expr);
+		if (IntegerLiteral *intliteral = dyn_cast<IntegerLiteral>(expr))
+			ops.push_back(VecOp{VEC_CONST, EK_I64, 0, intliteral->getValue().getSExtValue()});
+		else if (CharacterLiteral *charliteral = dyn_cast<CharacterLiteral>(expr))
+			ops.push_back(VecOp{VEC_CONST, EK_I64, 0, (int64_t)charliteral->getValue()});
+		else if (const VarDecl *vardecl = localScalar(expr)){
+			if (index && vardecl == index)
+				ops.push_back(VecOp{VEC_INDEX, EK_I64, 0, 0});
+			else
+				ops.push_back(VecOp{VEC_SCALAR, EK_I64, slotOf(vardecl), 0});
+		}
+		else if (ArraySubscriptExpr *element = dyn_cast<ArraySubscriptExpr>(expr)){
+			ElemKind kind;
+			const VarDecl *array = index ? localArray(element->getBase(), kind) : NULL;
+			if (!array || local(element->getIdx()) != index)
+				return false;
+			ops.push_back(VecOp{VEC_LOAD, kind, slotOf(array), 0});
+		}
+		else if (UnaryOperator *uop = dyn_cast<UnaryOperator>(expr)){
+			if (uop->getOpcode() == UO_Plus)
+				return operands(uop->getSubExpr(), index, ops, depth, peak);
+			if (uop->getOpcode() != UO_Minus || !operands(uop->getSubExpr(), index, ops, depth, peak))
+				return false;
+			ops.push_back(VecOp{VEC_NEG, EK_I64, 0, 0});
+			return true;
+		}
+		else if (BinaryOperator *bop = dyn_cast<BinaryOperator>(expr)){
+			VecOpKind kind;
+			switch (bop->getOpcode()){
+			case BO_Add: kind = VEC_ADD; break;
+			case BO_Sub: kind = VEC_SUB; break;
+			case BO_Mul: kind = VEC_MUL; break;
+			default: return false;
+			}
+			if (!operands(bop->getLHS(), index, ops, depth, peak) || !operands(bop->getRHS(), index, ops, depth, peak))
+				return false;
+			ops.push_back(VecOp{kind, EK_I64, 0, 0});
+			depth--;
+			return true;
+		}
+		else
+			return false;
+		if (++depth > peak)
+			peak = depth;
+		return peak <= vec::MaxDepth;
+	}
+};
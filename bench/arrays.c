@@ -0,0 +1,21 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Array fill and sum as in test/test12.c and test/test21.c, over a
+// million elements; GET reads how many rounds to make.
+
+int main() {
+   int a[1000000];
+   int rounds, r, i, sum;
+   rounds = GET();
+   sum = 0;
+   for (r = 0; r < rounds; r = r + 1) {
+      for (i = 0; i < 1000000; i = i + 1)
+         a[i] = i + r;
+      for (i = 0; i < 1000000; i = i + 1)
+         sum = sum + a[i] - i;
+   }
+   PRINT(sum);
+}
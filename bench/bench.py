@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+"""Runs the bench/ workloads and reports them as JSON.
+
+For every workload this records guest operations per second, peak RSS and
+the interpreter's own parse/execute split (--timing); engine jit is the VM
+with --jit, and also records how much of execute went to compiling. With --baseline it
+fails when any workload's ops/sec drops by more than --threshold against
+the stored numbers; --update-baseline records the current run instead.
+
+  bench.py --interpreter build/ast-interpreter [--engine vm|ast|jit]
+           [--scale 0.1] [--baseline bench/baseline.json] [--threshold 0.1]
+"""
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def fib(n):
+    a, b = 0, 1
+    for _ in range(n):
+        a, b = b, a + b
+    return a
+
+
+# name -> (program, input for a given scale, ops, expected output)
+def workloads(scale):
+    n_fib = max(2, 27 + int(round(_log_phi(scale))))
+    n_loop = max(1, int(10000 * scale ** 0.5))
+    rounds = max(1, int(10 * scale))
+    n_malloc = max(1, int(1000000 * scale))
+    return {
+        "fib": ("fib.c", n_fib, 2 * fib(n_fib + 1) - 1, fib(n_fib)),
+        "loops": ("loops.c", n_loop, n_loop * n_loop, n_loop * n_loop),
+        "arrays": ("arrays.c", rounds, 2 * 1000000 * rounds,
+                   sum(r * 1000000 for r in range(rounds))),
+        "malloc": ("malloc.c", n_malloc, 2 * n_malloc,
+                   n_malloc * (n_malloc - 1) // 2 + n_malloc),
+        "calls": ("calls.c", None, 242785, 75025),
+    }
+
+
+def _log_phi(scale):
+    # fib(n) costs grow by the golden ratio per step of n
+    return math.log(scale) / math.log((1 + 5 ** 0.5) / 2)
+
+
+def run(interpreter, engine, program, stdin):
+    flags = ["--engine=vm", "--jit", "--jit-stats"] if engine == "jit" else ["--engine=" + engine]
+    cmd = [interpreter] + flags + ["--no-cache", "--no-prompt", "--timing",
+                                   os.path.join(BENCH_DIR, program)]
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE)
+    out, err = proc.communicate(b"" if stdin is None else b"%d\n" % stdin)
+    seconds = time.perf_counter() - start
+    return out.decode(), err.decode(), seconds, proc.returncode
+
+
+def measure(interpreter, engine, program, stdin):
+    """Runs one workload through a probe process so peak RSS is its own"""
+    probe = subprocess.run(
+        [sys.executable, __file__, "--probe", interpreter, engine, program,
+         "" if stdin is None else str(stdin)],
+        stdout=subprocess.PIPE, check=True)
+    return json.loads(probe.stdout)
+
+
+def probe(interpreter, engine, program, stdin):
+    """Runs in its own process: RUSAGE_CHILDREN then covers just this run"""
+    import resource
+    out, err, seconds, code = run(interpreter, engine, program,
+                                  None if stdin == "" else int(stdin))
+    timing = re.search(r"timing: parse ([0-9.]+) ms, execute ([0-9.]+) ms", err)
+    jit = re.search(r"jit: .* compiled in ([0-9.]+) ms", err)
+    json.dump({
+        "output": out,
+        "stderr": err,
+        "returncode": code,
+        "seconds": seconds,
+        "peak_rss_kb": resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss,
+        "parse_ms": float(timing.group(1)) if timing else None,
+        "execute_ms": float(timing.group(2)) if timing else None,
+        "compile_ms": float(jit.group(1)) if jit else None,
+    }, sys.stdout)
+
+
+def main():
+    if len(sys.argv) > 1 and sys.argv[1] == "--probe":
+        probe(*sys.argv[2:6])
+        return 0
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--interpreter", required=True)
+    parser.add_argument("--engine", default="vm", choices=["vm", "ast", "jit"])
+    parser.add_argument("--scale", type=float, default=1.0,
+                        help="multiplies every workload's size")
+    parser.add_argument("--only", action="append",
+                        help="run just this workload; may repeat")
+    parser.add_argument("--output", help="also write the JSON report here")
+    parser.add_argument("--baseline", help="stored report to compare against")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="largest tolerated ops/sec drop, as a fraction")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="write this run to --baseline instead of comparing")
+    args = parser.parse_args()
+
+    report = {"engine": args.engine, "scale": args.scale, "workloads": {}}
+    failed = False
+    for name, (program, stdin, ops, expected) in workloads(args.scale).items():
+        if args.only and name not in args.only:
+            continue
+        result = measure(args.interpreter, args.engine, program, stdin)
+        got = result["output"].split()
+        ok = result["returncode"] == 0 and got == [str(expected)]
+        if not ok:
+            print("%s: wrong output %r, expected %d\n%s" % (name, got, expected, result["stderr"]),
+                  file=sys.stderr)
+            failed = True
+        report["workloads"][name] = {
+            "ops": ops,
+            "seconds": round(result["seconds"], 6),
+            "ops_per_sec": round(ops / result["seconds"], 1),
+            "peak_rss_kb": result["peak_rss_kb"],
+            "parse_ms": result["parse_ms"],
+            "execute_ms": result["execute_ms"],
+            "correct": ok,
+        }
+        if result["compile_ms"] is not None:
+            report["workloads"][name]["compile_ms"] = result["compile_ms"]
+
+    text = json.dumps(report, indent=2)
+    print(text)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+
+    if args.baseline and args.update_baseline:
+        with open(args.baseline, "w") as f:
+            f.write(text + "\n")
+    elif args.baseline:
+        if not os.path.exists(args.baseline):
+            print("no baseline at %s; record one with --update-baseline" % args.baseline,
+                  file=sys.stderr)
+        else:
+            with open(args.baseline) as f:
+                baseline = json.load(f)
+            if baseline.get("engine") != args.engine or baseline.get("scale") != args.scale:
+                print("baseline was recorded for engine %s at scale %s; not comparing"
+                      % (baseline.get("engine"), baseline.get("scale")), file=sys.stderr)
+            else:
+                for name, now in report["workloads"].items():
+                    before = baseline["workloads"].get(name)
+                    if not before:
+                        continue
+                    change = now["ops_per_sec"] / before["ops_per_sec"] - 1
+                    status = "ok"
+                    if change < -args.threshold:
+                        status = "REGRESSION"
+                        failed = True
+                    print("%-8s %+7.1f%% ops/sec  %s" % (name, change * 100, status),
+                          file=sys.stderr)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
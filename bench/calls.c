@@ -0,0 +1,21 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Call-overhead microbenchmark: fibonacci(25) makes 242785 guest calls,
+// each ending in a return.
+//   time ast-interpreter --engine=ast "$(cat bench/calls.c)"
+
+int fibonacci(int n) {
+   if (n < 2)
+      return n;
+   return fibonacci(n - 1) + fibonacci(n - 2);
+}
+
+int main() {
+   PRINT(fibonacci(25));
+   return 0;
+}
+
+//75025
@@ -0,0 +1,20 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Recursive fibonacci as in test/test20.c, with N read by GET.
+// fibonacci(N) makes 2 * fib(N + 1) - 1 guest calls.
+
+int fibonacci(int b) {
+   if (b < 2)
+      return b;
+   return fibonacci(b - 1) + fibonacci(b - 2);
+}
+
+int main() {
+   int n;
+   n = GET();
+   PRINT(fibonacci(n));
+   return 0;
+}
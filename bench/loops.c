@@ -0,0 +1,23 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Nested while loops as in test/test11.c, N by N iterations with N read
+// by GET; N = 10000 runs the inner body 10^8 times.
+
+int main() {
+   int n, a, b, c;
+   n = GET();
+   a = 0;
+   c = 0;
+   while (a < n) {
+      a = a + 1;
+      b = 0;
+      while (b < n) {
+         b = b + 1;
+         c = c + 1;
+      }
+   }
+   PRINT(c);
+}
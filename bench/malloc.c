@@ -0,0 +1,25 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// MALLOC/FREE churn as in test/test17.c: GET reads N, then N blocks of
+// one to three words are allocated, written, read back and freed.
+
+int main() {
+   int *p;
+   int *q;
+   int n, i, sum;
+   n = GET();
+   sum = 0;
+   for (i = 0; i < n; i = i + 1) {
+      p = (int *)MALLOC(sizeof(int));
+      q = (int *)MALLOC(sizeof(int) * (1 + i - i / 3 * 3));
+      *p = i;
+      *q = 1;
+      sum = sum + *p + *q;
+      FREE(q);
+      FREE(p);
+   }
+   PRINT(sum);
+}
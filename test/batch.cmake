@@ -0,0 +1,20 @@
+# Runs every program a manifest lists one after another, then on four
+# jobs, which have to print the same and exit with the same status.
+# Guest addresses differ from run to run, so they aren't compared.
+#   cmake -DINTERPRETER=<ast-interpreter> -DMANIFEST=<file> -DENGINE=vm|ast -P batch.cmake
+
+foreach(jobs 1 4)
+  execute_process(
+    COMMAND ${INTERPRETER} --engine=${ENGINE} --no-cache --no-prompt --jobs=${jobs} --batch=${MANIFEST}
+    INPUT_FILE /dev/null
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE errors
+    RESULT_VARIABLE result)
+  string(REGEX REPLACE "0x[0-9a-f]+" "0x" output "${output}")
+  set(output${jobs} "${output}")
+  set(result${jobs} "${result}")
+endforeach()
+if(NOT "${output4}" STREQUAL "${output1}" OR NOT "${result4}" STREQUAL "${result1}")
+  message(FATAL_ERROR "--jobs=4 exited with ${result4} and printed\n${output4}"
+                      "one at a time, it exited with ${result1} and printed\n${output1}")
+endif()
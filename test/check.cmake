@@ -0,0 +1,30 @@
+# Runs one test program and compares the numbers it prints with the ones
+# listed in its last // comment. A program expected to end with a guest
+# error names it in a "// error! <message>" comment; the error line is
+# then required, and left out of the numbers compared.
+#   cmake -DINTERPRETER=<ast-interpreter> -DPROGRAM=<test.c> -DENGINE=vm|ast
+#         [-DOPTIONS=<more options>] [-DERROR=<message>]
+#         -DEXPECTED=<numbers> -P check.cmake
+
+execute_process(
+  COMMAND ${INTERPRETER} --engine=${ENGINE} --no-cache --no-prompt ${OPTIONS} ${PROGRAM}
+  INPUT_FILE /dev/null
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE errors
+  RESULT_VARIABLE result)
+
+# Which error line, if any, the program has to end with
+string(FIND "${output}" "error! ${ERROR}" at)
+if(ERROR)
+  if(at EQUAL -1)
+    set(error_wrong TRUE)
+  endif()
+elseif(NOT at EQUAL -1)
+  set(error_wrong TRUE)
+endif()
+string(REGEX REPLACE "error! [^\n]*" "" numbers "${output}")
+string(REGEX MATCHALL "-?[0-9]+" printed "${numbers}")
+if(NOT result EQUAL 0 OR NOT "${printed}" STREQUAL "${EXPECTED}" OR error_wrong)
+  message(FATAL_ERROR "${PROGRAM} on the ${ENGINE} engine printed\n${output}${errors}"
+                      "expected: ${EXPECTED} ${ERROR}")
+endif()
@@ -0,0 +1,21 @@
+# Runs a test program that calls SNAPSHOT() with --snapshot, then restores
+# the snapshot in a second run, which has to print what the first one did.
+# The program prints nothing before its SNAPSHOT() call.
+#   cmake -DINTERPRETER=<ast-interpreter> -DPROGRAM=<test.c> -DSNAPSHOT=<file>
+#         -DEXPECTED=<numbers> -P snapshot.cmake
+
+file(REMOVE ${SNAPSHOT})
+foreach(run snapshot restore)
+  execute_process(
+    COMMAND ${INTERPRETER} --engine=vm --no-cache --no-prompt --${run}=${SNAPSHOT} ${PROGRAM}
+    INPUT_FILE /dev/null
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE errors
+    RESULT_VARIABLE result)
+  string(REGEX MATCHALL "-?[0-9]+" printed "${output}")
+  if(NOT result EQUAL 0 OR NOT "${printed}" STREQUAL "${EXPECTED}" OR output MATCHES "error! ")
+    message(FATAL_ERROR "${PROGRAM} run with --${run} printed\n${output}${errors}"
+                        "expected: ${EXPECTED}")
+  endif()
+endforeach()
+file(REMOVE ${SNAPSHOT})
@@ -0,0 +1,32 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// break and continue in nested while loops
+int main() {
+   int i;
+   int j;
+   int sum;
+   i = 0;
+   sum = 0;
+   while (i < 10) {
+      i = i + 1;
+      if (i == 3)
+         continue;
+      if (i == 8)
+         break;
+      j = 0;
+      while (1) {
+         j = j + 1;
+         if (j > i)
+            break;
+         if (j == 2)
+            continue;
+         sum = sum + j;
+      }
+   }
+   PRINT(i);
+   PRINT(sum);
+}
+//8 68
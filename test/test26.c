@@ -0,0 +1,38 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// break, continue and return inside for loops
+int find(int limit) {
+   int i;
+   for (i = 0; i < limit; i = i + 1) {
+      if (i * i > 50)
+         return i;
+   }
+   return -1;
+}
+int main() {
+   int i;
+   int j;
+   int sum;
+   sum = 0;
+   for (i = 0; i < 10; i = i + 1) {
+      if (i == 2)
+         continue;
+      for (j = 0; j < 10; j = j + 1) {
+         if (j == i)
+            break;
+         if (j == 1)
+            continue;
+         sum = sum + j;
+      }
+      if (i == 6)
+         break;
+   }
+   PRINT(i);
+   PRINT(sum);
+   PRINT(find(100));
+   PRINT(find(5));
+}
+//6 30 8 -1
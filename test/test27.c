@@ -0,0 +1,21 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// A block freed twice ends the program
+// error! double free of
+int main() {
+   int *a;
+   int *b;
+   a = (int *)MALLOC(sizeof(int) * 4);
+   b = (int *)MALLOC(sizeof(int) * 4);
+   a[3] = 7;
+   b[0] = a[3] + 1;
+   PRINT(b[0]);
+   FREE(a);
+   FREE(b);
+   FREE(a);
+   PRINT(1);
+}
+//8
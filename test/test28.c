@@ -0,0 +1,16 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Freeing what MALLOC didn't return ends the program
+// error! invalid free of
+int main() {
+   int *a;
+   a = (int *)MALLOC(sizeof(int) * 4);
+   a[0] = 5;
+   PRINT(a[0]);
+   FREE(a + 1);
+   PRINT(1);
+}
+//5
@@ -0,0 +1,29 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Pure functions are memoized; calls with side effects still happen
+// options: --memoize=1024
+int calls;
+int fib(int n) {
+   if (n < 2)
+      return n;
+   return fib(n - 1) + fib(n - 2);
+}
+int count(int n) {
+   calls = calls + 1;
+   return calls + n;
+}
+int show(int n) {
+   PRINT(n);
+   return n;
+}
+int main() {
+   PRINT(fib(32));
+   PRINT(fib(32));
+   PRINT(count(10));
+   PRINT(count(10));
+   PRINT(show(3) + show(3));
+}
+//2178309 2178309 11 12 3 3 6
@@ -0,0 +1,22 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// Recursion deeper than --stack-limit allows ends the program, not the
+// interpreter
+// options: --stack-limit=1m
+// error! guest stack overflow
+int down(int n) {
+   int pad[16];
+   pad[0] = n;
+   if (n == 0)
+      return 0;
+   return down(n - 1) + pad[0] - n + 1;
+}
+int main() {
+   PRINT(down(100));
+   PRINT(down(100000));
+   PRINT(1);
+}
+//100
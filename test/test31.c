@@ -0,0 +1,46 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(long);
+
+// Loads, stores and pointer arithmetic step by the element's width
+int main() {
+   char s[8];
+   int n[4];
+   long w[3];
+   char *p;
+   int *q;
+   int *r[2];
+   long *x;
+   int i;
+   for (i = 0; i < 8; i = i + 1)
+      s[i] = i * 40;
+   p = s + 2;
+   PRINT(*p);
+   PRINT(*(p + 5));
+   PRINT(p[-1]);
+   s[0] = 300;
+   PRINT(s[0]);
+   PRINT((p + 4) - s);
+   n[0] = 7;
+   n[1] = -8;
+   n[2] = 9;
+   n[3] = 2147483647;
+   q = n;
+   q = q + 3;
+   PRINT(*q);
+   PRINT(*(q - 2));
+   PRINT(q - n);
+   r[0] = n + 1;
+   r[1] = n + 2;
+   PRINT(*r[0] + *r[1]);
+   PRINT(r[1] - r[0]);
+   w[0] = 50000;
+   w[0] = w[0] * 100000;
+   w[1] = -1;
+   w[2] = 3;
+   x = w + 1;
+   PRINT(*x + *(x + 1));
+   PRINT(*(x - 1) / 1000);
+}
+//80 24 40 44 6 2147483647 -8 3 1 1 2 5000000
@@ -0,0 +1,44 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(long);
+
+// Vectorized int and char loops: odd lengths, a <= bound, char wraparound, an empty loop
+int main() {
+   int a[37];
+   int b[37];
+   char c[70];
+   char d[70];
+   int i;
+   int n;
+   int k;
+   long sum;
+   n = 37;
+   k = 5;
+   for (i = 0; i < n; i = i + 1)
+      b[i] = i * 3 - 50;
+   PRINT(i);
+   for (i = 1; i <= n - 2; i = i + 1)
+      a[i] = b[i] * b[i] + i - k;
+   PRINT(i);
+   a[0] = 0;
+   a[36] = 0;
+   for (i = 0; i < 70; i = i + 1)
+      d[i] = i * 7;
+   for (i = 3; i < 67; i = i + 1)
+      c[i] = d[i] * 2 + 1;
+   for (i = 10; i < 4; i = i + 1)
+      c[i] = 0;
+   PRINT(i);
+   sum = 0;
+   for (i = 0; i < 37; i = i + 1)
+      sum = sum + a[i] * (i + 1);
+   PRINT(sum);
+   sum = 0;
+   for (i = 3; i < 67; i = i + 1)
+      sum = sum + c[i] * i;
+   PRINT(sum);
+   PRINT(c[66]);
+}
+
+//37 36 10 719005 -288 -99
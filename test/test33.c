@@ -0,0 +1,19 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+// An access far outside the guest's memory stops it with a fault
+// error! invalid memory access at
+int main() {
+   int a[4];
+   int *p;
+   a[0] = 7;
+   p = MALLOC(16);
+   p[3] = 9;
+   PRINT(a[0] + p[3]);
+   p[1000000000] = 1;
+   PRINT(1);
+}
+
+//16
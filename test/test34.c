@@ -0,0 +1,42 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern long SNAPSHOT();
+
+// A run restored from SNAPSHOT() picks up its frames, heap and globals
+int total;
+int table[8];
+
+int build(int *p, int n) {
+   int i;
+   int sum;
+   sum = 0;
+   for (i = 0; i < n; i = i + 1) {
+      p[i] = i * i + total;
+      sum = sum + p[i];
+   }
+   SNAPSHOT();
+   total = total + sum;
+   return sum * 2;
+}
+
+int main() {
+   int *p;
+   int i;
+   int r;
+   total = 3;
+   for (i = 0; i < 8; i = i + 1)
+      table[i] = i * 10;
+   p = MALLOC(40);
+   r = build(p, 10);
+   PRINT(r);
+   PRINT(total);
+   PRINT(p[9] + table[7]);
+   FREE(p);
+   p = MALLOC(8);
+   p[0] = 11;
+   PRINT(p[0]);
+}
+
+//630 318 154 11
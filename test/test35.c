@@ -0,0 +1,64 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(long);
+extern long SPAWN(long (*fn)(long), long arg);
+extern long JOIN(long handle);
+extern long ATOMIC_ADD(long *p, long v);
+extern long ATOMIC_CAS(long *p, long expected, long desired);
+
+// Guest threads: JOIN returns what the thread did, and the atomics don't lose updates
+long *counter;
+
+long work(long n) {
+   long i;
+   long sum;
+   sum = 0;
+   for (i = 0; i < n; i = i + 1) {
+      ATOMIC_ADD(counter, 1);
+      sum = sum + i;
+   }
+   return sum;
+}
+
+long claim(long id) {
+   long old;
+   long done;
+   done = 0;
+   while (done == 0) {
+      old = counter[1];
+      if (ATOMIC_CAS(counter + 1, old, old + id) == old)
+         done = 1;
+   }
+   return id * 100;
+}
+
+int main() {
+   long h[8];
+   long i;
+   long total;
+   counter = MALLOC(16);
+   counter[0] = 0;
+   counter[1] = 0;
+   total = 0;
+   for (i = 0; i < 8; i = i + 1)
+      h[i] = SPAWN(work, 20000);
+   for (i = 0; i < 8; i = i + 1)
+      total = total + JOIN(h[i]);
+   PRINT(counter[0]);
+   PRINT(total);
+   total = 0;
+   for (i = 0; i < 8; i = i + 1)
+      h[i] = SPAWN(claim, i + 1);
+   for (i = 0; i < 8; i = i + 1)
+      total = total + JOIN(h[i]);
+   PRINT(counter[1]);
+   PRINT(total);
+   PRINT(ATOMIC_ADD(counter, 5));
+   PRINT(ATOMIC_CAS(counter, 7, 1));
+   PRINT(ATOMIC_CAS(counter, 160005, 1));
+   PRINT(counter[0]);
+   FREE(counter);
+}
+
+//160000 1599920000 36 3600 160000 160005 160005 1
@@ -0,0 +1,37 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(long);
+
+// Global int and char arrays, initialized globals and pointers into them
+int g[10];
+char name[6];
+long bias = 3 * 7;
+int *cursor;
+
+long fill(long n) {
+   long i;
+   for (i = 0; i < n; i = i + 1)
+      g[i] = i * i;
+   return n;
+}
+
+int main() {
+   long i;
+   long s;
+   s = 0;
+   fill(10);
+   for (i = 0; i < 10; i = i + 1)
+      s = s + g[i];
+   PRINT(s + bias);
+   for (i = 0; i < 6; i = i + 1)
+      name[i] = 100 + i * 10;
+   PRINT(name[5]);
+   cursor = g + 4;
+   cursor[1] = -7;
+   PRINT(*cursor + g[5]);
+   bias = bias - 1;
+   PRINT(bias);
+}
+
+//306 -106 9 20